@@ -4,8 +4,253 @@
 #include <cmath>
 #include <algorithm>
 #include <string>
+#include <sstream>
+#include <cstdlib>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 using namespace std;
 
+//***************************************************************************************************//
+//                          IMAGE BUFFER ALLOCATION AND MEMORY ACCOUNTING                            //
+//***************************************************************************************************//
+
+// Bytes currently held by image buffers, and the most held at any one time
+atomic<long long> image_bytes_live(0);
+atomic<long long> image_bytes_peak(0);
+
+// Memory mapped for image buffers comes in whole huge pages
+const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+// Buffers and row blocks of at least this many bytes get memory mapped,
+// backed by huge pages where the system has them. Rounding up to a whole
+// huge page then wastes at most an eighth of the mapping.
+const size_t MIN_MAPPED_BYTES = 8 * HUGE_PAGE_BYTES;
+
+// Bytes in front of every image buffer that say where it came from. Just
+// one pointer, so a row of one pixel still fits the smallest heap chunk.
+// The SSE2 loops use unaligned loads.
+const size_t BUFFER_HEADER_BYTES = sizeof(void*);
+
+// Rows carved from a block start on a new cache line
+const size_t CACHE_LINE_BYTES = 64;
+
+// Narrower rows are allocated one by one, as carving them from a block
+// would waste too much of each cache line
+const size_t MIN_CARVED_ROW_BYTES = 16 * CACHE_LINE_BYTES;
+
+// Memory mapped for image buffers, unmapped when its last buffer is freed
+struct BufferBlock
+{
+    char* memory;
+    size_t bytes;
+    atomic<long long> buffers;  // Buffers in the block, plus one while rows are still being carved
+};
+
+// While set, image buffers allocated on this thread are carved from this
+// part of a block one after the other, see allocate_rows()
+thread_local BufferBlock* row_block = nullptr;
+thread_local char* row_block_next = nullptr;
+thread_local char* row_block_end = nullptr;
+
+// While set, new pixels allocated on this thread are not zeroed, see allocate_rows()
+thread_local bool leave_uninitialised = false;
+
+/**
+ * Adds to the bytes held by image buffers and raises the peak to match
+ * @param bytes the change, negative when memory is given back
+ */
+void count_image_bytes(long long bytes)
+{
+    long long live = image_bytes_live += bytes;
+    long long peak = image_bytes_peak;
+    while (live > peak && !image_bytes_peak.compare_exchange_weak(peak, live))
+    {
+    }
+}
+
+/**
+ * Rounds a size up to whole huge pages, the size of a mapping
+ * @param bytes the size
+ * @return the rounded size
+ */
+size_t whole_huge_pages(size_t bytes)
+{
+    return (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+}
+
+/**
+ * Maps memory for image buffers without touching it. Tries explicit huge
+ * pages first, then asks for transparent huge pages.
+ * @param bytes the size, rounded up to whole huge pages
+ * @return the block holding one reference, or nullptr if nothing could be mapped
+ */
+BufferBlock* map_block(size_t bytes)
+{
+    bytes = whole_huge_pages(bytes);
+    void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (memory == MAP_FAILED)
+    {
+        memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            return nullptr;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    count_image_bytes(bytes);
+    return new BufferBlock{(char*)memory, bytes, {1}};
+}
+
+/**
+ * Drops one reference to a block and unmaps it after the last one
+ * @param block the block
+ */
+void release_block(BufferBlock* block)
+{
+    if (--block->buffers == 0)
+    {
+        count_image_bytes(-(long long)block->bytes);
+        munmap(block->memory, block->bytes);
+        delete block;
+    }
+}
+
+/**
+ * Gets the bytes taken by one buffer carved from a block
+ * @param bytes the size of the buffer
+ * @return the size with its header, rounded up to whole cache lines
+ */
+size_t carved_bytes(size_t bytes)
+{
+    return (bytes + BUFFER_HEADER_BYTES + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+}
+
+/**
+ * Gets the bytes counted for a buffer that is allocated on its own, not
+ * carved from a block
+ * @param bytes the size of the buffer
+ * @return the size with its header, in whole huge pages if it is mapped
+ */
+long long counted_bytes(long long bytes)
+{
+    if (bytes >= (long long)MIN_MAPPED_BYTES)
+    {
+        return whole_huge_pages(bytes + BUFFER_HEADER_BYTES);
+    }
+    return bytes + BUFFER_HEADER_BYTES;
+}
+
+/**
+ * Allocator for image buffers. Keeps image_bytes_live and image_bytes_peak
+ * up to date with the memory really taken: whole mapped blocks, or the
+ * buffer and its header. Large buffers are memory mapped with huge pages,
+ * and the rows of a large image can be carved from one block, see
+ * allocate_rows().
+ */
+template <typename T>
+struct ImageAllocator
+{
+    typedef T value_type;
+
+    ImageAllocator() {}
+
+    template <typename U>
+    ImageAllocator(const ImageAllocator<U>&) {}
+
+    T* allocate(size_t count)
+    {
+        size_t bytes = count * sizeof(T);
+        BufferBlock* block = nullptr;
+        char* memory;
+        if (row_block != nullptr && row_block_next + carved_bytes(bytes) <= row_block_end)
+        {
+            // The next row of the image being made
+            block = row_block;
+            block->buffers++;
+            memory = row_block_next;
+            row_block_next = row_block_next + carved_bytes(bytes);
+        }
+        else if (bytes >= MIN_MAPPED_BYTES && (block = map_block(bytes + BUFFER_HEADER_BYTES)) != nullptr)
+        {
+            memory = block->memory;
+        }
+        else
+        {
+            memory = (char*)::operator new(bytes + BUFFER_HEADER_BYTES);
+            count_image_bytes(bytes + BUFFER_HEADER_BYTES);
+        }
+        *(BufferBlock**)memory = block;
+        return (T*)(memory + BUFFER_HEADER_BYTES);
+    }
+
+    void deallocate(T* pointer, size_t count)
+    {
+        char* memory = (char*)pointer - BUFFER_HEADER_BYTES;
+        BufferBlock* block = *(BufferBlock**)memory;
+        if (block == nullptr)
+        {
+            count_image_bytes(-(long long)(count * sizeof(T) + BUFFER_HEADER_BYTES));
+            ::operator delete(memory);
+        }
+        else
+        {
+            release_block(block);
+        }
+    }
+
+    // New pixels of the rows from allocate_rows() are left uninitialised,
+    // everywhere else new elements are zeroed as usual
+    template <typename U>
+    void construct(U* pointer)
+    {
+        if (leave_uninitialised)
+        {
+            ::new ((void*)pointer) U;
+        }
+        else
+        {
+            ::new ((void*)pointer) U();
+        }
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const ImageAllocator<T>&, const ImageAllocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const ImageAllocator<T>&, const ImageAllocator<U>&)
+{
+    return false;
+}
+
 //***************************************************************************************************//
 //                      THIS SECTION WAS GIVEN BY THE PROFESSOR                                  //
 //***************************************************************************************************//
@@ -19,6 +264,22 @@ struct Pixel
     int blue;
 };
 
+// An image is a vector of rows of Pixels, top row first
+typedef vector<Pixel, ImageAllocator<Pixel>> PixelRow;
+typedef vector<PixelRow, ImageAllocator<PixelRow>> Image;
+
+// Red, green, blue floats per pixel, used by the convolution
+typedef vector<float, ImageAllocator<float>> FloatImage;
+
+// A rectangle of an image in pixels. A width of 0 means the whole image.
+struct Region
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
 /**
  * Gets an integer from a binary stream.
  * Helper function for read_image()
@@ -45,7 +306,7 @@ int get_int(fstream& stream, int offset, int bytes)
  * @param filename BMP image filename
  * @return the image as a vector of vector of Pixels
  */
-vector<vector<Pixel>> read_image(string filename)
+Image read_image(string filename)
 {
     // Open the binary file
     fstream stream;
@@ -73,7 +334,7 @@ vector<vector<Pixel>> read_image(string filename)
     }
 
     // Create a vector the size of the input image
-    vector<vector<Pixel>> image(height, vector<Pixel> (width));
+    Image image(height, PixelRow (width));
 
     int pos = start;
     // For each row, starting from the last row to the first
@@ -132,7 +393,7 @@ void set_bytes(unsigned char arr[], int offset, int bytes, int value)
  * @param image    The input image to save
  * @return True if successful and false otherwise
  */
-bool write_image(string filename, const vector<vector<Pixel>>& image)
+bool write_image(string filename, const Image& image)
 {
     // Get the image width and height in pixels
     int width_pixels = image[0].size();
@@ -218,7 +479,7 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
 
 // Process 1 (Vignette)
 
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
+Image process_1(const Image& image)
 {
     // Set variables
 
@@ -227,7 +488,7 @@ vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
 
     // Define new 2D vector
 
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    Image new_image(num_rows, PixelRow (num_columns));
 
     // Iterate through row and col
 
@@ -266,7 +527,7 @@ vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
 
 // Process 2 (Clarendon - darks darker and lights lighter)
 
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+Image process_2(const Image& image, double scaling_factor)
 {
     // Set variables
 
@@ -275,7 +536,7 @@ vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scali
     
     // Define new empty 2D vector
 
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    Image new_image(num_rows, PixelRow (num_columns));
 
     // Iterate through row and col
 
@@ -327,7 +588,7 @@ vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scali
 
 // Process 3 (Greyscale)
 
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+Image process_3(const Image& image)
 {
     // Set variables
 
@@ -336,7 +597,7 @@ vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
     
     // Define new empty 2D vector
 
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    Image new_image(num_rows, PixelRow (num_columns));
 
     // Iterate through row and col
 
@@ -373,7 +634,7 @@ vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
 
 // Process 4 (Rotate by 90 clockwise)
 
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+Image process_4(const Image& image)
 {
     // Set variables
 
@@ -382,7 +643,7 @@ vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
     
     // Define new empty 2D vector
 
-    vector<vector<Pixel>> new_image(num_columns, vector<Pixel> (num_rows));
+    Image new_image(num_columns, PixelRow (num_rows));
 
     // Iterate through row and col
 
@@ -401,7 +662,7 @@ vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
 // Process 5 (Rotate by multiples of 90 clockwise)
 
 
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+Image process_5(const Image& image, int number)
 {
     int angle = number * 90;
 
@@ -429,7 +690,7 @@ vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
 
 // Process 6 (Scale image x and y direction)
 
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+Image process_6(const Image& image, int x_scale, int y_scale)
 {
     // Set variables
 
@@ -438,7 +699,7 @@ vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale,
     
     // Define new empty 2D vector
 
-    vector<vector<Pixel>> new_image(num_rows * y_scale, vector<Pixel> (num_columns * x_scale));
+    Image new_image(num_rows * y_scale, PixelRow (num_columns * x_scale));
 
     // Iterate through row and col
 
@@ -456,7 +717,7 @@ vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale,
 
 // Process 7 High Contrast
 
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
+Image process_7(const Image& image)
 {
     // Set variables
 
@@ -465,7 +726,7 @@ vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
     
     // Define new empty 2D vector
 
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    Image new_image(num_rows, PixelRow (num_columns));
 
     // Iterate through row and col
 
@@ -511,7 +772,7 @@ vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
 
 // Process 8 Lighten
 
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)
+Image process_8(const Image& image, double scaling_factor)
 {
     // Set variables
 
@@ -520,7 +781,7 @@ vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scali
     
     // Define new empty 2D vector
 
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    Image new_image(num_rows, PixelRow (num_columns));
 
     // Iterate through row and col
 
@@ -554,7 +815,7 @@ vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scali
 
 // Process 9 Darken
 
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
+Image process_9(const Image& image, double scaling_factor)
 {
     // Set variables
 
@@ -563,7 +824,7 @@ vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scali
     
     // Define new empty 2D vector
 
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    Image new_image(num_rows, PixelRow (num_columns));
 
     // Iterate through row and col
 
@@ -595,7 +856,7 @@ vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scali
     return new_image;
 }
 
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
+Image process_10(const Image& image)
 {
     // Set variables
 
@@ -604,7 +865,7 @@ vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
     
     // Define new empty 2D vector
 
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    Image new_image(num_rows, PixelRow (num_columns));
 
     // Iterate through row and col
 
@@ -667,108 +928,4029 @@ vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
     return new_image;
 }
 
-int main()
+//***************************************************************************************************//
+//                                 ALLOCATING LARGE IMAGES                                           //
+//***************************************************************************************************//
+
+/**
+ * Gets the number of threads to use
+ * @param threads the requested number, 0 for one per hardware thread
+ * @return the number of threads, at least 1
+ */
+int thread_count(int threads)
 {
-    cout << "CSPB 1300 Image Processing Application\n";
-    cout << "Enter the name of the BMP file to process: ";
-    string filename;
+    if (threads <= 0)
+    {
+        threads = thread::hardware_concurrency();
+    }
+    return max(threads, 1);
+}
 
-    while (cin >> filename)
+// Threads that make_image() touches new pages with, 0 for one per hardware
+// thread. Set from --threads in command line mode.
+int image_threads = 0;
+
+// Set on the thread of a background job to its cancel flag. The decoder and
+// the row loops of the processes stop early once the flag is set, leaving
+// an unfinished image the job throws away.
+thread_local const atomic<bool>* job_cancel = nullptr;
+
+/**
+ * Checks if the background job running on this thread was cancelled
+ * @return True if it was and false otherwise, always false outside a job
+ */
+bool job_cancelled()
+{
+    return job_cancel != nullptr && *job_cancel;
+}
+
+/**
+ * Gets the size of the block that holds all the rows of an image
+ * @param width  WIDTH of the image
+ * @param height HEIGHT of the image
+ * @return the bytes of the carved rows, or 0 if the image is small or its
+ *         rows are narrow, so they are allocated one by one
+ */
+long long row_block_bytes(long long width, long long height)
+{
+    long long row_bytes = width * sizeof(Pixel);
+    long long bytes = carved_bytes(row_bytes) * height;
+    if (row_bytes < (long long)MIN_CARVED_ROW_BYTES || bytes < (long long)MIN_MAPPED_BYTES)
     {
-        menu:
-        cout << "---------------------------------------\n\n";
-        cout << "IMAGE PROCESSING MENU\n\n";
-        cout << "0) Change image (current: " << filename << ")\n";
-        cout << "1) Vignette\n";
-        cout << "2) Clarendon\n";
-        cout << "3) Grayscale\n";
-        cout << "4) Rotate by 90 degrees clockwise\n";
-        cout << "5) Rotate by multiple 90 degrees\n";
-        cout << "6) Enlarge in x and y direction\n";
-        cout << "7) High contrast black and white\n";
-        cout << "8) Lighten by scaling factor\n";
-        cout << "9) Darken by scaling factor\n";
-        cout << "10) Convert to black, white, red, blue, green only\n\n";
-        cout << "Enter your selection (Q to quit): ";
-        string user_input;
-        cin >> user_input;
-        cout << "\n";   
+        return 0;
+    }
+    return bytes;
+}
 
-        if (user_input == "0")
-        {
-            cout << "Change image selected\n\n";
-            cout << "Enter the name of the new BMP file to process: ";
-            cin >> filename;
-            cout << "\n";
-            cout << "New Filename: " << filename << "\n\n";
-            vector<vector<Pixel>> image = read_image(filename);
-            cout << "Successfully changed image to " << filename << "!" << "\n";
-            goto menu;
-        }
-        else if (user_input == "1")
+/**
+ * Maps one block for all the rows of a large image
+ * @param width  WIDTH of the image
+ * @param height HEIGHT of the image
+ * @return the block, or nullptr if the rows are allocated one by one (see
+ *         row_block_bytes()) or nothing could be mapped. Call
+ *         release_block() once all rows are allocated.
+ */
+BufferBlock* map_row_block(int width, int height)
+{
+    long long bytes = row_block_bytes(width, height);
+    return bytes > 0 ? map_block(bytes) : nullptr;
+}
+
+/**
+ * Allocates rows first ... last - 1 of an image, in row order from their
+ * part of the block when there is one. The pixels are not zeroed, so the
+ * caller must write all of them before they are read.
+ * @param image the image, holding height empty rows
+ * @param width WIDTH of the rows
+ * @param block the block from map_row_block(), or nullptr
+ * @param first the first row
+ * @param last  one past the last row
+ */
+void allocate_rows(Image& image, int width, BufferBlock* block, int first, int last)
+{
+    if (block != nullptr)
+    {
+        row_block = block;
+        row_block_next = block->memory + first * carved_bytes(width * sizeof(Pixel));
+        row_block_end = block->memory + last * carved_bytes(width * sizeof(Pixel));
+    }
+    leave_uninitialised = true;
+    for (int row = first; row < last; row++)
+    {
+        image[row].resize(width);
+    }
+    leave_uninitialised = false;
+    row_block = nullptr;
+}
+
+/**
+ * Makes an image without zeroing its pixels. The rows of a large image come
+ * from one huge page backed block, and image_threads threads each touch the
+ * pages of a band of rows so the page faults run in parallel. Other images
+ * are allocated on the calling thread.
+ * @param width  WIDTH of the image
+ * @param height HEIGHT of the image
+ * @return the image, its pixels must all be written before they are read
+ */
+Image make_image(int width, int height)
+{
+    Image image(height);
+    BufferBlock* block = map_row_block(width, height);
+    if (block == nullptr)
+    {
+        allocate_rows(image, width, nullptr, 0, height);
+        return image;
+    }
+
+    long page_bytes = sysconf(_SC_PAGESIZE);
+    auto touch_band = [&](int first, int last)
+    {
+        allocate_rows(image, width, block, first, last);
+        for (int row = first; row < last; row++)
         {
-            vector<vector<Pixel>> image = read_image(filename);
-            cout << "Vignette selected\n\n";
-            cout << "Enter output BMP filename: ";
-            string new_filename;
-            cin >> new_filename;
-            cout << "\n";
-            cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_1(image);
-            bool success = write_image(new_filename, new_image);
-            cout << "Successfully applied vignette!\n\n\n";
-            goto menu;
+            char* bytes = (char*)image[row].data();
+            for (size_t offset = 0; offset < width * sizeof(Pixel); offset += page_bytes)
+            {
+                bytes[offset] = 0;
+            }
         }
-        else if (user_input == "2")
+    };
+
+    int threads = min(thread_count(image_threads), height);
+    vector<thread> workers;
+    for (int band = 0; band < threads; band++)
+    {
+        workers.push_back(thread(touch_band, (long long)height * band / threads,
+                                 (long long)height * (band + 1) / threads));
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    release_block(block);
+    return image;
+}
+
+//***************************************************************************************************//
+//                                 DOWNSCALING AND THUMBNAIL PYRAMIDS                                //
+//***************************************************************************************************//
+
+// The downscaling loops treat a row of Pixels as one flat array of ints
+static_assert(sizeof(Pixel) == 3 * sizeof(int), "Pixel must be three packed ints");
+
+/**
+ * Adds the color values of a row to running sums, one 64 bit sum per channel
+ * (red, green, blue, red, ...) so large blocks can't overflow. Uses SSE2
+ * when the compiler targets it.
+ * Helper function for process_11() and the thumbnail pyramid
+ * @param sums the running sums, at least 3 * row.size() of them
+ * @param row  the row to add
+ */
+void add_row(vector<long long>& sums, const PixelRow& row)
+{
+    const int* values = &row[0].red;
+    long long* totals = sums.data();
+    int count = row.size() * 3;
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4)
+    {
+        // Sign extend four ints to two pairs of 64 bit values
+        __m128i value = _mm_loadu_si128((const __m128i*)(values + i));
+        __m128i sign = _mm_srai_epi32(value, 31);
+        __m128i low = _mm_unpacklo_epi32(value, sign);
+        __m128i high = _mm_unpackhi_epi32(value, sign);
+        __m128i total_low = _mm_loadu_si128((const __m128i*)(totals + i));
+        __m128i total_high = _mm_loadu_si128((const __m128i*)(totals + i + 2));
+        _mm_storeu_si128((__m128i*)(totals + i), _mm_add_epi64(total_low, low));
+        _mm_storeu_si128((__m128i*)(totals + i + 2), _mm_add_epi64(total_high, high));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        totals[i] = totals[i] + values[i];
+    }
+}
+
+/**
+ * Blends two rows into a row of floats, one float per channel:
+ * out = first + (second - first) * weight. Uses SSE2 when the compiler targets it.
+ * Helper function for process_12()
+ * @param out    the blended channels, at least 3 * first.size() floats
+ * @param first  the upper row
+ * @param second the lower row
+ * @param weight how far to move from first towards second, 0 to 1
+ */
+void blend_rows(vector<float>& out, const PixelRow& first, const PixelRow& second, float weight)
+{
+    const int* top = &first[0].red;
+    const int* bottom = &second[0].red;
+    float* blended = out.data();
+    int count = first.size() * 3;
+    int i = 0;
+#ifdef __SSE2__
+    __m128 weights = _mm_set1_ps(weight);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 a = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(top + i)));
+        __m128 b = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(bottom + i)));
+        _mm_storeu_ps(blended + i, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), weights)));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        blended[i] = top[i] + (bottom[i] - top[i]) * weight;
+    }
+}
+
+/**
+ * Averages blocks of columns of summed rows into a new row.
+ * Helper function for process_11() and the thumbnail pyramid
+ * @param sums     the channel sums of num_rows rows, see add_row()
+ * @param width    WIDTH of the summed rows
+ * @param x_scale  number of columns in each block
+ * @param num_rows number of rows that were summed
+ * @return the averaged row, ceil(width / x_scale) pixels long
+ */
+PixelRow average_columns(const vector<long long>& sums, int width, int x_scale, int num_rows)
+{
+    int new_width = (width + x_scale - 1) / x_scale;
+    PixelRow row(new_width);
+    for (int col = 0; col < new_width; col++)
+    {
+        int first = col * x_scale;
+        int last = min(first + x_scale, width);
+        long long red = 0, green = 0, blue = 0;
+        for (int i = first; i < last; i++)
         {
-            vector<vector<Pixel>> image = read_image(filename);
-            cout << "Clarendon selected\n\n";
-            cout << "Enter scaling factor: ";
-            double scaling_factor;
-            cin >> scaling_factor;
-            cout << "\n";
-            cout << "Selected scaling factor: " << scaling_factor << "\n\n";
-            cout << "Enter output BMP filename: ";
-            string new_filename;
-            cin >> new_filename;
-            cout << "\n";
-            cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_2(image, scaling_factor);
-            bool success = write_image(new_filename, new_image);
-            cout << "Successfully applied clarendon!" << "\n";
-            goto menu;            
+            red = red + sums[3 * i];
+            green = green + sums[3 * i + 1];
+            blue = blue + sums[3 * i + 2];
         }
-        else if (user_input == "3")
+
+        // Round to the nearest value
+        long long count = (long long)(last - first) * num_rows;
+        row[col].red = (red + count / 2) / count;
+        row[col].green = (green + count / 2) / count;
+        row[col].blue = (blue + count / 2) / count;
+    }
+    return row;
+}
+
+// Process 11 (Shrink by area averaging)
+
+Image process_11(const Image& image, int x_scale, int y_scale)
+{
+    // Set variables
+
+    int num_rows = image.size();       // HEIGHT
+    int num_columns = image[0].size(); // WIDTH
+    int new_rows = (num_rows + y_scale - 1) / y_scale;
+
+    // Define new 2D vector, blocks at the right and bottom edges may be partial
+
+    Image new_image(new_rows);
+    vector<long long> sums(num_columns * 3);
+
+    // Sum each block of rows, then average each block of columns
+
+    for (int row = 0; row < new_rows && !job_cancelled(); row++)
+    {
+        int first = row * y_scale;
+        int last = min(first + y_scale, num_rows);
+        fill(sums.begin(), sums.end(), 0);
+        for (int i = first; i < last; i++)
         {
-            vector<vector<Pixel>> image = read_image(filename);
-            cout << "Grayscale selected\n\n";
-            cout << "Enter output BMP filename: ";
-            string new_filename;
-            cin >> new_filename;
-            cout << "\n";
-            cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_3(image);
-            bool success = write_image(new_filename, new_image);
-            cout << "Successfully applied grayscale!" << "\n";
-            goto menu;
+            add_row(sums, image[i]);
         }
-        else if (user_input == "4")
-        {
-            vector<vector<Pixel>> image = read_image(filename);
-            cout << "Rotate 90 degrees selected\n\n";
+        new_image[row] = average_columns(sums, num_columns, x_scale, last - first);
+    }
+    // return new image
+
+    return new_image;
+}
+
+// Process 12 (Resize with bilinear interpolation)
+
+Image process_12(const Image& image, int new_columns, int new_rows)
+{
+    // Set variables
+
+    int num_rows = image.size();       // HEIGHT
+    int num_columns = image[0].size(); // WIDTH
+    double y_ratio = (double)num_rows / new_rows;
+    double x_ratio = (double)num_columns / new_columns;
+
+    // Work out the two source columns and the weight of each new column once
+
+    vector<int> left(new_columns), right(new_columns);
+    vector<float> x_weight(new_columns);
+    for (int col = 0; col < new_columns; col++)
+    {
+        double x = min(max((col + 0.5) * x_ratio - 0.5, 0.0), num_columns - 1.0);
+        left[col] = x;
+        right[col] = min(left[col] + 1, num_columns - 1);
+        x_weight[col] = x - left[col];
+    }
+
+    // Define new 2D vector
+
+    Image new_image = make_image(new_columns, new_rows);
+    vector<float> blended(num_columns * 3);
+
+    // Blend the two source rows, then the two source columns
+
+    for (int row = 0; row < new_rows && !job_cancelled(); row++)
+    {
+        double y = min(max((row + 0.5) * y_ratio - 0.5, 0.0), num_rows - 1.0);
+        int top = y;
+        int bottom = min(top + 1, num_rows - 1);
+        blend_rows(blended, image[top], image[bottom], y - top);
+
+        for (int col = 0; col < new_columns; col++)
+        {
+            const float* a = &blended[3 * left[col]];
+            const float* b = &blended[3 * right[col]];
+            float weight = x_weight[col];
+            new_image[row][col].red = a[0] + (b[0] - a[0]) * weight + 0.5f;
+            new_image[row][col].green = a[1] + (b[1] - a[1]) * weight + 0.5f;
+            new_image[row][col].blue = a[2] + (b[2] - a[2]) * weight + 0.5f;
+        }
+    }
+    // return new image
+
+    return new_image;
+}
+
+// Thumbnail pyramid (1/2, 1/4, 1/8, ...) built one source row at a time.
+// Every level is a 2x2 area average of the level above it, so each source
+// row is read once and the full size image never has to be held.
+struct Pyramid
+{
+    vector<Image> levels;   // levels[0] is 1/2, levels[1] is 1/4, ...
+    vector<vector<long long>> sums;         // Channel sums of the pending rows of each level
+    vector<int> pending;                    // Number of rows summed so far for each level
+    vector<int> widths;                     // WIDTH of the rows fed into each level
+    vector<int> heights;                    // HEIGHT of the rows fed into each level
+    vector<int> next_rows;                  // Index of the next row fed into each level, top row is 0
+    bool bottom_up;                         // True if rows arrive bottom row first (BMP)
+};
+
+/**
+ * Creates an empty thumbnail pyramid
+ * @param width     WIDTH of the source image
+ * @param height    HEIGHT of the source image
+ * @param levels    number of levels wanted, stops early when a level is 1x1
+ * @param bottom_up true if the source rows arrive bottom row first
+ * @return the pyramid, ready for pyramid_add_row()
+ */
+Pyramid make_pyramid(int width, int height, int levels, bool bottom_up = false)
+{
+    Pyramid pyramid;
+    pyramid.bottom_up = bottom_up;
+    while ((int)pyramid.levels.size() < levels && (width > 1 || height > 1))
+    {
+        pyramid.levels.push_back({});
+        pyramid.sums.push_back(vector<long long> (width * 3, 0));
+        pyramid.pending.push_back(0);
+        pyramid.widths.push_back(width);
+        pyramid.heights.push_back(height);
+        pyramid.next_rows.push_back(bottom_up ? height - 1 : 0);
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+    return pyramid;
+}
+
+void pyramid_feed_row(Pyramid& pyramid, int level, const PixelRow& row);
+
+/**
+ * Emits the pending rows of a level as one row of that level and passes it
+ * down to the next level. Helper function for pyramid_feed_row()
+ * @param pyramid the pyramid
+ * @param level   the level to emit a row for
+ */
+void pyramid_emit_row(Pyramid& pyramid, int level)
+{
+    PixelRow row = average_columns(pyramid.sums[level], pyramid.widths[level], 2, pyramid.pending[level]);
+    fill(pyramid.sums[level].begin(), pyramid.sums[level].end(), 0);
+    pyramid.pending[level] = 0;
+
+    if (level + 1 < (int)pyramid.levels.size())
+    {
+        pyramid_feed_row(pyramid, level + 1, row);
+    }
+    pyramid.levels[level].push_back(row);
+}
+
+/**
+ * Adds a row to a level. Rows 0 and 1, 2 and 3, ... (counted from the top)
+ * are averaged together in either arrival order, and the last row of an
+ * odd HEIGHT is averaged on its own.
+ * Helper function for pyramid_add_row()
+ * @param pyramid the pyramid
+ * @param level   the level
+ * @param row     the next row of that level
+ */
+void pyramid_feed_row(Pyramid& pyramid, int level, const PixelRow& row)
+{
+    int index = pyramid.next_rows[level];
+    pyramid.next_rows[level] = pyramid.bottom_up ? index - 1 : index + 1;
+    add_row(pyramid.sums[level], row);
+    pyramid.pending[level]++;
+
+    bool complete = pyramid.bottom_up ? index % 2 == 0 : index % 2 == 1 || index == pyramid.heights[level] - 1;
+    if (complete)
+    {
+        pyramid_emit_row(pyramid, level);
+    }
+}
+
+/**
+ * Feeds the next source row into the pyramid
+ * @param pyramid the pyramid from make_pyramid()
+ * @param row     the next row of the source image
+ */
+void pyramid_add_row(Pyramid& pyramid, const PixelRow& row)
+{
+    if (!pyramid.levels.empty())
+    {
+        pyramid_feed_row(pyramid, 0, row);
+    }
+}
+
+/**
+ * Emits the rows left over when the source ended early
+ * @param pyramid the pyramid, after the last source row was added
+ */
+void pyramid_finish(Pyramid& pyramid)
+{
+    for (int level = 0; level < (int)pyramid.levels.size(); level++)
+    {
+        if (pyramid.pending[level] > 0)
+        {
+            pyramid_emit_row(pyramid, level);
+        }
+    }
+}
+
+// Process 13 (Thumbnail pyramid)
+
+vector<Image> process_13(const Image& image, int levels)
+{
+    Pyramid pyramid = make_pyramid(image[0].size(), image.size(), levels);
+    for (int row = 0; row < (int)image.size(); row++)
+    {
+        pyramid_add_row(pyramid, image[row]);
+    }
+    pyramid_finish(pyramid);
+    return pyramid.levels;
+}
+
+/**
+ * Adds a suffix to a file name before its extension, e.g. thumb.bmp -> thumb_4.bmp
+ * @param filename the file name
+ * @param suffix   the suffix
+ * @return the new file name
+ */
+string suffixed_filename(string filename, string suffix)
+{
+    size_t dot = filename.rfind('.');
+    if (dot == string::npos || filename.find('/', dot) != string::npos)
+    {
+        return filename + suffix;
+    }
+    return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+/**
+ * Gets the file name of a pyramid level, e.g. thumb.bmp -> thumb_4.bmp for 1/4
+ * @param filename the output file name given by the user
+ * @param level    the level, 0 for 1/2
+ * @return the file name of the level
+ */
+string pyramid_filename(string filename, int level)
+{
+    return suffixed_filename(filename, "_" + to_string(2 << level));
+}
+
+//***************************************************************************************************//
+//                             SEPARABLE CONVOLUTION (BLUR, SHARPEN, EDGES)                          //
+//***************************************************************************************************//
+
+// Rows handled per band of the separable convolution, at least
+const int CONVOLUTION_BAND_ROWS = 64;
+
+// Floats per column tile of the column pass (4 KB per row under the kernel)
+const int CONVOLUTION_TILE_FLOATS = 1024;
+
+// Largest Gaussian blur SIGMA, a kernel of 600001 weights
+const double MAX_BLUR_SIGMA = 100000;
+
+/**
+ * Clamps an index to 0 ... size - 1, repeating the edge pixels past the border
+ * @param index the index, may be outside the image
+ * @param size  number of rows or columns
+ * @return the clamped index
+ */
+int clamp_index(long long index, int size)
+{
+    return min(max(index, 0LL), size - 1LL);
+}
+
+/**
+ * Resolves a region against the size of an image. A width of 0 becomes the
+ * whole image, anything else is clipped to the image.
+ * @param region the region
+ * @param width  WIDTH of the image
+ * @param height HEIGHT of the image
+ * @return the region inside the image, may be empty (width or height 0)
+ */
+Region clip_region(Region region, int width, int height)
+{
+    if (region.width <= 0)
+    {
+        return {0, 0, width, height};
+    }
+    int left = min(max(region.x, 0), width);
+    int top = min(max(region.y, 0), height);
+    int right = min(max(region.x + region.width, left), width);
+    int bottom = min(max(region.y + region.height, top), height);
+    return {left, top, right - left, bottom - top};
+}
+
+/**
+ * Multiplies an array of floats by a weight and adds it to another array:
+ * out = out + in * weight. Uses SSE2 when the compiler targets it.
+ * Helper function for convolve_separable()
+ * @param out    the array to add to
+ * @param in     the array to multiply
+ * @param weight the weight
+ * @param count  number of floats
+ */
+void multiply_add(float* out, const float* in, float weight, int count)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128 weights = _mm_set1_ps(weight);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 sum = _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), weights));
+        _mm_storeu_ps(out + i, sum);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        out[i] = out[i] + in[i] * weight;
+    }
+}
+
+/**
+ * Makes a normalized 1D Gaussian kernel reaching out to 3 standard deviations
+ * @param sigma the standard deviation in pixels
+ * @return the kernel, 2 * radius + 1 weights
+ */
+vector<float> gaussian_kernel(double sigma)
+{
+    int radius = max(1, (int)ceil(3 * sigma));
+    vector<float> kernel(2 * radius + 1);
+    double total = 0;
+    for (int i = -radius; i <= radius; i++)
+    {
+        kernel[i + radius] = exp(-((double)i * i) / (2 * sigma * sigma));
+        total = total + kernel[i + radius];
+    }
+    for (size_t i = 0; i < kernel.size(); i++)
+    {
+        kernel[i] = kernel[i] / total;
+    }
+    return kernel;
+}
+
+/**
+ * Adds up the weights of kernel[first] ... kernel[last - 1], the taps that
+ * all read the same edge pixel. Helper function for convolve_separable()
+ * @param kernel the kernel
+ * @param prefix prefix[k] is the sum of the first k weights
+ * @param first  the first tap
+ * @param last   one past the last tap
+ * @return the sum, exactly the weight when there is one tap
+ */
+float folded_weight(const vector<float>& kernel, const vector<double>& prefix, int first, int last)
+{
+    if (last - first == 1)
+    {
+        return kernel[first];
+    }
+    return prefix[last] - prefix[first];
+}
+
+/**
+ * Makes the running sums of a kernel's weights. Helper function for convolve_separable()
+ * @param kernel the kernel
+ * @return kernel.size() + 1 sums, the first is 0
+ */
+vector<double> prefix_sums(const vector<float>& kernel)
+{
+    vector<double> prefix(kernel.size() + 1, 0);
+    for (size_t i = 0; i < kernel.size(); i++)
+    {
+        prefix[i + 1] = prefix[i] + kernel[i];
+    }
+    return prefix;
+}
+
+/**
+ * Convolves an image with a separable kernel: a row pass with row_kernel
+ * followed by a column pass with column_kernel. Pixels past the border
+ * repeat the edge pixels. The image is done in bands of rows so the row pass
+ * output stays small, and the column pass works in column tiles so the rows
+ * under the kernel stay in cache. Only the pixels of the region are
+ * computed; pixels around it are still used as neighbours. Each image row
+ * goes through the row pass once per band, and the kernel taps that only
+ * reach past the border are folded into one weight on the edge pixel, so a
+ * kernel wider than the image costs no more than one as wide as the image.
+ * @param image         the input image
+ * @param row_kernel    odd number of weights across each row
+ * @param column_kernel odd number of weights down each column
+ * @param region        the pixels to compute, see clip_region()
+ * @return the unrounded result, 3 floats (red, green, blue) per pixel of the region, top row first
+ */
+FloatImage convolve_separable(const Image& image, const vector<float>& row_kernel,
+                              const vector<float>& column_kernel, Region region = {0, 0, 0, 0})
+{
+    // Set variables
+
+    int num_rows = image.size();       // HEIGHT
+    int num_columns = image[0].size(); // WIDTH
+    Region area = clip_region(region, num_columns, num_rows);
+    int row_floats = area.width * 3;
+    int x_radius = row_kernel.size() / 2;
+    int y_radius = column_kernel.size() / 2;
+    int row_taps = row_kernel.size();
+    int column_taps = column_kernel.size();
+    int band_rows = min(max(CONVOLUTION_BAND_ROWS, 4 * y_radius), area.height);
+    vector<double> row_prefix = prefix_sums(row_kernel);
+    vector<double> column_prefix = prefix_sums(column_kernel);
+
+    // Taps that read past the left (top) edge from every pixel of the image
+    // come first, then the ones that can read the image, and the rest read
+    // past the right (bottom) edge from every pixel. Tap k reads k - radius
+    // pixels away. The split does not depend on the region, so a region
+    // gets the same pixels as the whole image.
+    int left_taps = clamp(x_radius - num_columns + 2, 0, row_taps);
+    int right_start = clamp(x_radius + num_columns - 1, left_taps, row_taps);
+    int top_taps = clamp(y_radius - num_rows + 2, 0, column_taps);
+    int bottom_start = clamp(y_radius + num_rows - 1, top_taps, column_taps);
+    int first_column = area.x - x_radius + left_taps;
+    float left_weight = left_taps > 0 ? folded_weight(row_kernel, row_prefix, 0, left_taps) : 0;
+    float right_weight = right_start < row_taps ? folded_weight(row_kernel, row_prefix, right_start, row_taps) : 0;
+    float top_weight = top_taps > 0 ? folded_weight(column_kernel, column_prefix, 0, top_taps) : 0;
+    float bottom_weight = bottom_start < column_taps
+                          ? folded_weight(column_kernel, column_prefix, bottom_start, column_taps) : 0;
+
+    FloatImage result((size_t)area.height * row_floats, 0.0f);
+    vector<float> extended((right_start - left_taps + area.width) * 3);
+    vector<float> left_edge(row_floats), right_edge(row_floats);
+    FloatImage band((size_t)min(band_rows + 2 * y_radius, num_rows) * row_floats);
+
+    for (int band_start = area.y; band_start < area.y + area.height && !job_cancelled(); band_start += band_rows)
+    {
+        int band_end = min(band_start + band_rows, area.y + area.height);
+
+        // Row pass over the image rows the band reads, up to y_radius rows
+        // above and below it
+
+        int first_row = clamp_index(band_start - y_radius, num_rows);
+        int last_row = clamp_index(band_end - 1 + y_radius, num_rows);
+        for (int i = first_row; i <= last_row; i++)
+        {
+            const PixelRow& source = image[i];
+            for (int col = first_column; col < first_column + (int)extended.size() / 3; col++)
+            {
+                const Pixel& pixel = source[clamp_index(col, num_columns)];
+                float* value = &extended[3 * (col - first_column)];
+                value[0] = pixel.red;
+                value[1] = pixel.green;
+                value[2] = pixel.blue;
+            }
+
+            float* out = &band[(size_t)(i - first_row) * row_floats];
+            fill(out, out + row_floats, 0.0f);
+            if (left_taps > 0)
+            {
+                for (int j = 0; j < row_floats; j += 3)
+                {
+                    left_edge[j] = source[0].red;
+                    left_edge[j + 1] = source[0].green;
+                    left_edge[j + 2] = source[0].blue;
+                }
+                multiply_add(out, left_edge.data(), left_weight, row_floats);
+            }
+            for (int k = left_taps; k < right_start; k++)
+            {
+                multiply_add(out, &extended[3 * (k - left_taps)], row_kernel[k], row_floats);
+            }
+            if (right_start < row_taps)
+            {
+                const Pixel& edge = source[num_columns - 1];
+                for (int j = 0; j < row_floats; j += 3)
+                {
+                    right_edge[j] = edge.red;
+                    right_edge[j + 1] = edge.green;
+                    right_edge[j + 2] = edge.blue;
+                }
+                multiply_add(out, right_edge.data(), right_weight, row_floats);
+            }
+        }
+
+        // Column pass, one tile of columns at a time
+
+        for (int tile = 0; tile < row_floats; tile += CONVOLUTION_TILE_FLOATS)
+        {
+            int count = min(CONVOLUTION_TILE_FLOATS, row_floats - tile);
+            for (int row = band_start; row < band_end; row++)
+            {
+                float* out = &result[(size_t)(row - area.y) * row_floats + tile];
+                if (top_taps > 0)
+                {
+                    multiply_add(out, &band[(size_t)(0 - first_row) * row_floats + tile], top_weight, count);
+                }
+                for (int k = top_taps; k < bottom_start; k++)
+                {
+                    int source = clamp_index(row - y_radius + k, num_rows);
+                    const float* in = &band[(size_t)(source - first_row) * row_floats + tile];
+                    multiply_add(out, in, column_kernel[k], count);
+                }
+                if (bottom_start < column_taps)
+                {
+                    const float* in = &band[(size_t)(num_rows - 1 - first_row) * row_floats + tile];
+                    multiply_add(out, in, bottom_weight, count);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Rounds convolution results back to an image, clamping to 0 ... 255
+ * @param values      3 floats per pixel, see convolve_separable()
+ * @param num_rows    HEIGHT
+ * @param num_columns WIDTH
+ * @return the image
+ */
+Image float_to_image(const FloatImage& values, int num_rows, int num_columns)
+{
+    Image new_image = make_image(num_columns, num_rows);
+    const float* value = values.data();
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_columns; col++)
+        {
+            new_image[row][col].red = min(max(value[0] + 0.5f, 0.0f), 255.0f);
+            new_image[row][col].green = min(max(value[1] + 0.5f, 0.0f), 255.0f);
+            new_image[row][col].blue = min(max(value[2] + 0.5f, 0.0f), 255.0f);
+            value = value + 3;
+        }
+    }
+    return new_image;
+}
+
+// Process 14 (Gaussian blur)
+// Processes 14 to 17 return only the region when one is given
+
+Image process_14(const Image& image, double sigma, Region region = {0, 0, 0, 0})
+{
+    Region area = clip_region(region, image[0].size(), image.size());
+    vector<float> kernel = gaussian_kernel(sigma);
+    return float_to_image(convolve_separable(image, kernel, kernel, area), area.height, area.width);
+}
+
+// Largest box blur radius, the window sums of larger ones don't fit in 64 bits
+const int MAX_BOX_RADIUS = 50000000;
+
+/**
+ * Computes the running sums of a row across a window of 2 * radius + 1
+ * pixels, one 64 bit sum per channel. Window pixels past the border repeat
+ * the edge pixels, so the first window counts those copies instead of
+ * adding them one by one. Helper function for process_15()
+ * @param sums   set to 3 sums per pixel
+ * @param row    the row
+ * @param radius the window radius
+ * @param first  the first column to compute
+ * @param count  number of columns to compute
+ */
+void box_sum_row(long long* sums, const PixelRow& row, int radius, int first, int count)
+{
+    int num_columns = row.size();
+    long long left_copies = max(0LL, (long long)radius - first);
+    long long right_copies = max(0LL, (long long)first + radius - (num_columns - 1));
+    const Pixel& left = row[0];
+    const Pixel& right = row[num_columns - 1];
+    long long red = left_copies * left.red + right_copies * right.red;
+    long long green = left_copies * left.green + right_copies * right.green;
+    long long blue = left_copies * left.blue + right_copies * right.blue;
+    for (int i = clamp_index((long long)first - radius, num_columns);
+         i <= clamp_index((long long)first + radius, num_columns); i++)
+    {
+        red = red + row[i].red;
+        green = green + row[i].green;
+        blue = blue + row[i].blue;
+    }
+
+    for (int col = first; col < first + count; col++)
+    {
+        sums[3 * (col - first)] = red;
+        sums[3 * (col - first) + 1] = green;
+        sums[3 * (col - first) + 2] = blue;
+
+        // Slide the window one pixel right
+        const Pixel& incoming = row[clamp_index((long long)col + radius + 1, num_columns)];
+        const Pixel& outgoing = row[clamp_index((long long)col - radius, num_columns)];
+        red = red + incoming.red - outgoing.red;
+        green = green + incoming.green - outgoing.green;
+        blue = blue + incoming.blue - outgoing.blue;
+    }
+}
+
+// Process 15 (Box blur with running sums, same cost for any radius)
+
+Image process_15(const Image& image, int radius, Region region = {0, 0, 0, 0})
+{
+    // Set variables
+
+    int num_rows = image.size();       // HEIGHT
+    int num_columns = image[0].size(); // WIDTH
+    Region area = clip_region(region, num_columns, num_rows);
+    int row_values = area.width * 3;
+    long long window = (2LL * radius + 1) * (2LL * radius + 1);
+
+    // Row sums are kept in a ring holding just the rows under the window
+
+    int ring_rows = min(2LL * radius + 2, (long long)num_rows);
+    vector<long long, ImageAllocator<long long>> ring((size_t)ring_rows * row_values);
+    int computed = clamp_index((long long)area.y - radius, num_rows) - 1;
+    auto row_sums = [&](int index) -> const long long*
+    {
+        while (computed < index)
+        {
+            computed++;
+            box_sum_row(&ring[(size_t)(computed % ring_rows) * row_values], image[computed], radius, area.x, area.width);
+        }
+        return &ring[(size_t)(index % ring_rows) * row_values];
+    };
+
+    // Column sums of the window around the first row, in row order. Rows
+    // past the top and bottom repeat the edge rows, so those are counted.
+
+    vector<long long> column_sums(row_values, 0);
+    auto add_rows = [&](int index, long long copies)
+    {
+        const long long* sums = row_sums(index);
+        for (int j = 0; j < row_values; j++)
+        {
+            column_sums[j] = column_sums[j] + copies * sums[j];
+        }
+    };
+    long long top_copies = max(0LL, (long long)radius - area.y);
+    long long bottom_copies = max(0LL, (long long)area.y + radius - (num_rows - 1));
+    if (top_copies > 0)
+    {
+        add_rows(0, top_copies);
+    }
+    for (int i = clamp_index((long long)area.y - radius, num_rows); i <= clamp_index((long long)area.y + radius, num_rows); i++)
+    {
+        add_rows(i, 1);
+    }
+    if (bottom_copies > 0)
+    {
+        add_rows(num_rows - 1, bottom_copies);
+    }
+
+    // Define new 2D vector
+
+    Image new_image = make_image(area.width, area.height);
+
+    for (int row = area.y; row < area.y + area.height && !job_cancelled(); row++)
+    {
+        for (int col = 0; col < area.width; col++)
+        {
+            new_image[row - area.y][col].red = (column_sums[3 * col] + window / 2) / window;
+            new_image[row - area.y][col].green = (column_sums[3 * col + 1] + window / 2) / window;
+            new_image[row - area.y][col].blue = (column_sums[3 * col + 2] + window / 2) / window;
+        }
+
+        // Slide the window one row down
+        const long long* outgoing = row_sums(clamp_index((long long)row - radius, num_rows));
+        for (int j = 0; j < row_values; j++)
+        {
+            column_sums[j] = column_sums[j] - outgoing[j];
+        }
+        const long long* incoming = row_sums(clamp_index((long long)row + radius + 1, num_rows));
+        for (int j = 0; j < row_values; j++)
+        {
+            column_sums[j] = column_sums[j] + incoming[j];
+        }
+    }
+    // return new image
+
+    return new_image;
+}
+
+// Process 16 (Sharpen with an unsharp mask)
+
+Image process_16(const Image& image, double amount, Region region = {0, 0, 0, 0})
+{
+    // Blur, then push every pixel away from its blurred value
+
+    Region area = clip_region(region, image[0].size(), image.size());
+    vector<float> kernel = gaussian_kernel(1.0);
+    FloatImage values = convolve_separable(image, kernel, kernel, area);
+
+    float* value = values.data();
+    for (int row = area.y; row < area.y + area.height; row++)
+    {
+        for (int col = area.x; col < area.x + area.width; col++)
+        {
+            const Pixel& pixel = image[row][col];
+            value[0] = pixel.red + (pixel.red - value[0]) * amount;
+            value[1] = pixel.green + (pixel.green - value[1]) * amount;
+            value[2] = pixel.blue + (pixel.blue - value[2]) * amount;
+            value = value + 3;
+        }
+    }
+    return float_to_image(values, area.height, area.width);
+}
+
+// Process 17 (Sobel edge detection)
+
+Image process_17(const Image& image, Region region = {0, 0, 0, 0})
+{
+    // Both Sobel kernels are separable: a derivative one way, a smoothing the other
+
+    Region area = clip_region(region, image[0].size(), image.size());
+    vector<float> derivative = {-1, 0, 1};
+    vector<float> smoothing = {1, 2, 1};
+    FloatImage x_gradient = convolve_separable(image, derivative, smoothing, area);
+    FloatImage y_gradient = convolve_separable(image, smoothing, derivative, area);
+
+    for (size_t i = 0; i < x_gradient.size(); i++)
+    {
+        x_gradient[i] = sqrt(x_gradient[i] * x_gradient[i] + y_gradient[i] * y_gradient[i]);
+    }
+    return float_to_image(x_gradient, area.height, area.width);
+}
+
+//***************************************************************************************************//
+//                          STREAMING BMP / PPM / PAM INPUT AND OUTPUT                               //
+//***************************************************************************************************//
+
+// Properties of an image stream, enough to read or write it one row at a time
+struct ImageInfo
+{
+    string format;          // "bmp", "ppm" or "pam"
+    int width;              // WIDTH in pixels
+    int height;             // HEIGHT in pixels
+    int bytes_per_pixel;    // Bytes used by one pixel in the stream
+    int padding;            // Padding bytes at the end of each row (BMP only)
+    bool bottom_up;         // True if the last row is stored first (BMP)
+};
+
+/**
+ * Gets a little endian integer from a char array.
+ * This is the inverse of set_bytes() and a helper function for read_header()
+ * @param arr    Array to get the value from
+ * @param offset Starting index offset
+ * @param bytes  Number of bytes to get
+ * @return the integer starting at the given offset
+ */
+int get_bytes(const unsigned char arr[], int offset, int bytes)
+{
+    unsigned int result = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        result = (result << 8) | arr[offset + i];
+    }
+    return (int)result;
+}
+
+/**
+ * Reads the next whitespace separated token of a PPM header, skipping comments.
+ * The single whitespace character after the token is consumed as well.
+ * Helper function for read_header()
+ * @param stream the stream
+ * @param token  set to the token that was read
+ * @return True if a token was read and false otherwise
+ */
+bool read_pnm_token(istream& stream, string& token)
+{
+    token = "";
+    int c = stream.get();
+
+    // Skip whitespace and comment lines
+    while (c != EOF && (isspace(c) || c == '#'))
+    {
+        if (c == '#')
+        {
+            while (c != EOF && c != '\n')
+            {
+                c = stream.get();
+            }
+        }
+        c = stream.get();
+    }
+
+    while (c != EOF && !isspace(c))
+    {
+        token += (char)c;
+        c = stream.get();
+    }
+    return !token.empty();
+}
+
+/**
+ * Reads the header of a BMP, binary PPM (P6) or PAM (P7) stream and leaves
+ * the stream positioned at the first pixel row. Works on pipes, nothing is
+ * seeked.
+ * @param stream the stream
+ * @param info   set to the properties of the image
+ * @return True if the header is valid and supported and false otherwise
+ */
+bool read_header(istream& stream, ImageInfo& info)
+{
+    char magic[2];
+    if (!stream.read(magic, 2))
+    {
+        return false;
+    }
+
+    if (magic[0] == 'B' && magic[1] == 'M')
+    {
+        // BMP header (14 bytes) followed by at least a 40 byte DIB header
+        const int HEADER_BYTES = 54;
+        unsigned char header[HEADER_BYTES] = {0};
+        if (!stream.read((char*)header + 2, HEADER_BYTES - 2))
+        {
+            return false;
+        }
+
+        int start = get_bytes(header, 10, 4);
+        int dib_size = get_bytes(header, 14, 4);
+        int width = get_bytes(header, 18, 4);
+        int height = get_bytes(header, 22, 4);
+        int bits_per_pixel = get_bytes(header, 28, 2);
+        int compression = get_bytes(header, 30, 4);
+
+        // Only uncompressed 24 and 32 bit images are supported
+        if (dib_size < 40 || start < HEADER_BYTES || (bits_per_pixel != 24 && bits_per_pixel != 32)
+            || (compression != 0 && !(compression == 3 && bits_per_pixel == 32)))
+        {
+            return false;
+        }
+
+        // Skip the rest of the DIB header and any color masks
+        stream.ignore(start - HEADER_BYTES);
+
+        info.format = "bmp";
+        info.width = width;
+        info.height = abs(height);
+        info.bytes_per_pixel = bits_per_pixel / 8;
+        info.padding = (4 - (width * info.bytes_per_pixel) % 4) % 4;
+        info.bottom_up = height > 0;   // Negative height means top to bottom rows
+    }
+    else if (magic[0] == 'P' && magic[1] == '6')
+    {
+        string width, height, max_value;
+        if (!read_pnm_token(stream, width) || !read_pnm_token(stream, height)
+            || !read_pnm_token(stream, max_value) || max_value != "255")
+        {
+            return false;
+        }
+
+        info.format = "ppm";
+        info.width = atoi(width.c_str());
+        info.height = atoi(height.c_str());
+        info.bytes_per_pixel = 3;
+        info.padding = 0;
+        info.bottom_up = false;
+    }
+    else if (magic[0] == 'P' && magic[1] == '7')
+    {
+        info.format = "pam";
+        info.width = 0;
+        info.height = 0;
+        info.bytes_per_pixel = 0;
+        info.padding = 0;
+        info.bottom_up = false;
+
+        // PAM headers are "KEY value" lines up to ENDHDR
+        string line;
+        string max_value = "255";
+        getline(stream, line);
+        while (getline(stream, line) && line != "ENDHDR")
+        {
+            istringstream fields(line);
+            string key, value;
+            fields >> key >> value;
+            if (key == "WIDTH")
+            {
+                info.width = atoi(value.c_str());
+            }
+            else if (key == "HEIGHT")
+            {
+                info.height = atoi(value.c_str());
+            }
+            else if (key == "DEPTH")
+            {
+                info.bytes_per_pixel = atoi(value.c_str());
+            }
+            else if (key == "MAXVAL")
+            {
+                max_value = value;
+            }
+        }
+
+        // Grayscale, grayscale + alpha, RGB and RGB + alpha with 8 bit samples
+        if (line != "ENDHDR" || max_value != "255" || info.bytes_per_pixel < 1 || info.bytes_per_pixel > 4)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    return info.width > 0 && info.height > 0;
+}
+
+/**
+ * Creates the properties of an output stream of the given format
+ * @param format "bmp", "ppm" or "pam"
+ * @param width  WIDTH in pixels
+ * @param height HEIGHT in pixels
+ * @return the image properties
+ */
+ImageInfo make_output_info(string format, int width, int height)
+{
+    ImageInfo info;
+    info.format = format;
+    info.width = width;
+    info.height = height;
+    info.bytes_per_pixel = 3;
+    info.padding = 0;
+    info.bottom_up = false;
+    if (format == "bmp")
+    {
+        info.padding = (4 - (width * 3) % 4) % 4;
+        info.bottom_up = true;
+    }
+    return info;
+}
+
+/**
+ * Decodes one pixel in stream order.
+ * Helper function for read_row()
+ * @param bytes the bytes of the pixel
+ * @param info  the image properties from read_header()
+ * @param pixel set to the pixel
+ */
+inline void decode_pixel(const unsigned char* bytes, const ImageInfo& info, Pixel& pixel)
+{
+    if (info.format == "bmp")
+    {
+        // BMP files store pixels in blue, green, red order
+        pixel.blue = bytes[0];
+        pixel.green = bytes[1];
+        pixel.red = bytes[2];
+    }
+    else if (info.bytes_per_pixel < 3)
+    {
+        // Grayscale PAM
+        pixel.red = bytes[0];
+        pixel.green = bytes[0];
+        pixel.blue = bytes[0];
+    }
+    else
+    {
+        pixel.red = bytes[0];
+        pixel.green = bytes[1];
+        pixel.blue = bytes[2];
+    }
+    // We are ignoring the alpha channel if there is one
+}
+
+/**
+ * Reads one row of pixels in stream order.
+ * @param stream the stream, positioned at the start of a row
+ * @param info   the image properties from read_header()
+ * @param row    the row to fill, must hold info.width pixels
+ * @param bytes  scratch buffer reused between calls
+ * @return True if the whole row was read and false otherwise
+ */
+bool read_row(istream& stream, const ImageInfo& info, PixelRow& row, vector<unsigned char>& bytes)
+{
+    bytes.resize(info.width * info.bytes_per_pixel + info.padding);
+    if (!stream.read((char*)bytes.data(), bytes.size()))
+    {
+        return false;
+    }
+
+    const unsigned char* pixel = bytes.data();
+    for (int col = 0; col < info.width; col++)
+    {
+        decode_pixel(pixel, info, row[col]);
+        pixel = pixel + info.bytes_per_pixel;
+    }
+    return true;
+}
+
+/**
+ * Writes the header of a BMP, PPM or PAM stream.
+ * BMP headers match the ones written by write_image().
+ * @param stream the stream
+ * @param info   the image properties from make_output_info()
+ * @return True if successful and false otherwise
+ */
+bool write_header(ostream& stream, const ImageInfo& info)
+{
+    if (info.format == "bmp")
+    {
+        const int BMP_HEADER_SIZE = 14;
+        const int DIB_HEADER_SIZE = 40;
+        unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE] = {0};
+        unsigned char* dib_header = header + BMP_HEADER_SIZE;
+        int array_bytes = (info.width * 3 + info.padding) * info.height;
+
+        set_bytes(header,  0, 1, 'B');
+        set_bytes(header,  1, 1, 'M');
+        set_bytes(header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes);
+        set_bytes(header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE);
+        set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);
+        set_bytes(dib_header,  4, 4, info.width);
+        set_bytes(dib_header,  8, 4, info.height);
+        set_bytes(dib_header, 12, 2, 1);
+        set_bytes(dib_header, 14, 2, 24);
+        set_bytes(dib_header, 20, 4, array_bytes);
+        set_bytes(dib_header, 24, 4, 2835);
+        set_bytes(dib_header, 28, 4, 2835);
+        stream.write((char*)header, sizeof(header));
+    }
+    else if (info.format == "ppm")
+    {
+        stream << "P6\n" << info.width << " " << info.height << "\n255\n";
+    }
+    else
+    {
+        stream << "P7\nWIDTH " << info.width << "\nHEIGHT " << info.height
+               << "\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n";
+    }
+    return stream.good();
+}
+
+/**
+ * Writes one row of pixels in stream order.
+ * @param stream the stream
+ * @param info   the image properties from make_output_info()
+ * @param row    the row to write
+ * @param bytes  scratch buffer reused between calls
+ * @return True if successful and false otherwise
+ */
+bool write_row(ostream& stream, const ImageInfo& info, const PixelRow& row, vector<unsigned char>& bytes)
+{
+    // Padding bytes stay zero
+    bytes.assign(info.width * 3 + info.padding, 0);
+
+    unsigned char* pixel = bytes.data();
+    for (int col = 0; col < info.width; col++)
+    {
+        if (info.format == "bmp")
+        {
+            pixel[0] = row[col].blue;
+            pixel[1] = row[col].green;
+            pixel[2] = row[col].red;
+        }
+        else
+        {
+            pixel[0] = row[col].red;
+            pixel[1] = row[col].green;
+            pixel[2] = row[col].blue;
+        }
+        pixel = pixel + 3;
+    }
+    stream.write((char*)bytes.data(), bytes.size());
+    return stream.good();
+}
+
+/**
+ * Reads all pixel rows of a stream into an image, top row first.
+ * @param stream the stream, positioned after the header
+ * @param info   the image properties from read_header()
+ * @return the image, or an empty vector if the stream ended early
+ */
+Image read_rows(istream& stream, const ImageInfo& info)
+{
+    Image image = make_image(info.width, info.height);
+    vector<unsigned char> bytes;
+    for (int i = 0; i < info.height; i++)
+    {
+        int row = info.bottom_up ? info.height - 1 - i : i;
+        if (!read_row(stream, info, image[row], bytes))
+        {
+            return {};
+        }
+    }
+    return image;
+}
+
+/**
+ * Writes an image as a BMP, PPM or PAM stream.
+ * @param stream the stream
+ * @param format "bmp", "ppm" or "pam"
+ * @param image  the image to write, empty images are not written
+ * @return True if successful and false otherwise
+ */
+bool write_rows(ostream& stream, string format, const Image& image)
+{
+    if (image.empty())
+    {
+        return false;
+    }
+    ImageInfo info = make_output_info(format, image[0].size(), image.size());
+    write_header(stream, info);
+    vector<unsigned char> bytes;
+    for (int i = 0; i < info.height; i++)
+    {
+        int row = info.bottom_up ? info.height - 1 - i : i;
+        write_row(stream, info, image[row], bytes);
+    }
+    return stream.good();
+}
+
+//***************************************************************************************************//
+//                                   PARALLEL BMP DECODING                                           //
+//***************************************************************************************************//
+
+// Bytes each decoding thread reads per pread() call, at least one row
+const int DECODE_CHUNK_BYTES = 1 << 20;
+
+/**
+ * Reads exactly count bytes at offset, retrying short reads.
+ * Helper function for read_image_parallel()
+ * @param fd     the open file
+ * @param buffer where to put the bytes
+ * @param count  number of bytes
+ * @param offset position in the file
+ * @return True if all bytes were read and false otherwise
+ */
+bool pread_fully(int fd, unsigned char* buffer, size_t count, off_t offset)
+{
+    while (count > 0)
+    {
+        ssize_t done = pread(fd, buffer, count, offset);
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return false;
+        }
+        buffer = buffer + done;
+        count = count - done;
+        offset = offset + done;
+    }
+    return true;
+}
+
+/**
+ * Reads the BMP image specified using several threads. BMP rows sit at fixed
+ * offsets, so the pixel array is split into bands of rows and each thread
+ * reads its band with pread() and converts it straight into its own rows of
+ * the image. Gives the same image as read_image(), but goes by the length
+ * of the file rather than the size in its header, so files over 4 GB can
+ * be read. With a region only the rows of the region are read and only its
+ * pixels are kept.
+ * @param filename BMP image filename
+ * @param threads  number of threads, 0 for one per hardware thread
+ * @param region   the part of the image to read, see clip_region()
+ * @return the image as a vector of vector of Pixels, empty if the file is not a valid BMP
+ */
+Image read_image_parallel(string filename, int threads = 0, Region region = {0, 0, 0, 0})
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return {};
+    }
+
+    // Get the image properties
+    unsigned char header[54] = {0};
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || !pread_fully(fd, header, sizeof(header), 0)
+        || header[0] != 'B' || header[1] != 'M')
+    {
+        close(fd);
+        return {};
+    }
+    long long start = (unsigned int)get_bytes(header, 10, 4);
+    int width = get_bytes(header, 18, 4);
+    int height = get_bytes(header, 22, 4);
+    int bits_per_pixel = get_bytes(header, 28, 2);
+    bool bottom_up = height > 0;
+    height = abs(height);
+
+    // Scan lines must occupy multiples of four bytes
+    int bytes_per_pixel = bits_per_pixel / 8;
+    long long row_bytes = ((long long)width * bytes_per_pixel + 3) / 4 * 4;
+
+    // Return empty vector if this is not a valid image. The size in the
+    // header is not used, it is 0 in some files and can't hold sizes over 4 GB.
+    if (width <= 0 || height == 0 || (bits_per_pixel != 24 && bits_per_pixel != 32)
+        || file_stat.st_size < start + row_bytes * height)
+    {
+        close(fd);
+        return {};
+    }
+
+    Region area = clip_region(region, width, height);
+    if (area.width == 0 || area.height == 0)
+    {
+        close(fd);
+        return {};
+    }
+    // Each thread decodes one band of the region's rows, in file order.
+    // It allocates the band's rows itself and is the first to touch them.
+    Image image(area.height);
+    BufferBlock* block = map_row_block(area.width, area.height);
+    int first_row = bottom_up ? height - area.y - area.height : area.y;
+    threads = min(thread_count(threads), area.height);
+    int rows_per_chunk = max(1LL, DECODE_CHUNK_BYTES / row_bytes);
+    atomic<bool> failed(false);
+    const atomic<bool>* cancel = job_cancel;
+    auto decode_band = [&](int first, int last)
+    {
+        int top = (bottom_up ? height - last : first) - area.y;
+        allocate_rows(image, area.width, block, top, top + last - first);
+
+        vector<unsigned char> buffer(min(rows_per_chunk, last - first) * row_bytes);
+        for (int chunk = first; chunk < last && !failed && !(cancel != nullptr && *cancel); chunk += rows_per_chunk)
+        {
+            int rows = min(rows_per_chunk, last - chunk);
+            if (!pread_fully(fd, buffer.data(), rows * row_bytes, start + chunk * row_bytes))
+            {
+                failed = true;
+                return;
+            }
+            for (int i = 0; i < rows; i++)
+            {
+                // Note: BMP files store pixels in blue, green, red order
+                const unsigned char* pixel = &buffer[i * row_bytes + area.x * bytes_per_pixel];
+                PixelRow& row = image[(bottom_up ? height - 1 - (chunk + i) : chunk + i) - area.y];
+                for (int col = 0; col < area.width; col++)
+                {
+                    row[col].blue = pixel[0];
+                    row[col].green = pixel[1];
+                    row[col].red = pixel[2];
+                    pixel = pixel + bytes_per_pixel;
+                }
+            }
+        }
+    };
+
+    vector<thread> workers;
+    for (int band = 0; band < threads; band++)
+    {
+        int first = first_row + (long long)area.height * band / threads;
+        int last = first_row + (long long)area.height * (band + 1) / threads;
+        workers.push_back(thread(decode_band, first, last));
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    if (block != nullptr)
+    {
+        release_block(block);
+    }
+
+    close(fd);
+    if (failed)
+    {
+        return {};
+    }
+    // A cancelled job gets back the rows decoded so far and throws them away
+    return image;
+}
+
+//***************************************************************************************************//
+//                               ROW BY ROW VERSIONS OF THE POINT PROCESSES                          //
+//***************************************************************************************************//
+
+/**
+ * Checks if a process only depends on each pixel and its position, so it can
+ * be applied one row at a time while the image streams through.
+ * @param number the process number
+ * @return True for the point processes and false for the geometric ones
+ */
+bool is_point_process(int number)
+{
+    return number == 1 || number == 2 || number == 3 || number == 7
+        || number == 8 || number == 9 || number == 10;
+}
+
+/**
+ * Applies a point process to one row in place. Gives the same values as the
+ * matching process_N() on the whole image. The row can be part of a longer
+ * row, so a region of an image is changed without copying it.
+ * @param row            the first pixel to change
+ * @param width          WIDTH of the image (or region)
+ * @param row_index      index of the row in the image (or region), top row is 0
+ * @param num_rows       HEIGHT of the image (or region)
+ * @param number         the process number, see is_point_process()
+ * @param scaling_factor the scaling factor for processes 2, 8 and 9
+ */
+void process_row(Pixel* row, int width, int row_index, int num_rows, int number, double scaling_factor)
+{
+    double num_columns = width;
+    for (int col = 0; col < num_columns; col++)
+    {
+        int red_value = row[col].red;
+        int green_value = row[col].green;
+        int blue_value = row[col].blue;
+
+        if (number == 1) // Vignette
+        {
+            double distance = sqrt(pow((col - num_columns/2), 2) + pow((row_index - (double)num_rows/2), 2));
+            double vignette_factor = (num_rows - distance)/num_rows;
+            row[col].red = red_value * vignette_factor;
+            row[col].green = green_value * vignette_factor;
+            row[col].blue = blue_value * vignette_factor;
+        }
+        else if (number == 2) // Clarendon
+        {
+            double avg_value = ((red_value + green_value + blue_value) / 3);
+            if (avg_value >= 170)
+            {
+                row[col].red = (255 - (255 - red_value) * scaling_factor);
+                row[col].green = (255 - (255 - green_value) * scaling_factor);
+                row[col].blue = (255 - (255 - blue_value) * scaling_factor);
+            }
+            else if (avg_value < 90)
+            {
+                row[col].red = red_value * scaling_factor;
+                row[col].green = green_value * scaling_factor;
+                row[col].blue = blue_value * scaling_factor;
+            }
+        }
+        else if (number == 3) // Greyscale
+        {
+            int grey_value = (red_value + green_value + blue_value) / 3;
+            row[col].red = grey_value;
+            row[col].green = grey_value;
+            row[col].blue = grey_value;
+        }
+        else if (number == 7) // High contrast
+        {
+            int grey_value = (red_value + green_value + blue_value) / 3;
+            int new_value = grey_value >= 255 / 2 ? 255 : 0;
+            row[col].red = new_value;
+            row[col].green = new_value;
+            row[col].blue = new_value;
+        }
+        else if (number == 8) // Lighten
+        {
+            row[col].red = 255 - (255 - red_value) * scaling_factor;
+            row[col].green = 255 - (255 - green_value) * scaling_factor;
+            row[col].blue = 255 - (255 - blue_value) * scaling_factor;
+        }
+        else if (number == 9) // Darken
+        {
+            row[col].red = red_value * scaling_factor;
+            row[col].green = green_value * scaling_factor;
+            row[col].blue = blue_value * scaling_factor;
+        }
+        else if (number == 10) // Black, white, red, green, blue
+        {
+            int sum = red_value + green_value + blue_value;
+            int max_color = max(max(red_value, blue_value), green_value);
+            if (sum >= 550)
+            {
+                row[col] = {255, 255, 255};
+            }
+            else if (sum <= 150)
+            {
+                row[col] = {0, 0, 0};
+            }
+            else if (max_color == red_value)
+            {
+                row[col] = {255, 0, 0};
+            }
+            else if (max_color == green_value)
+            {
+                row[col] = {0, 255, 0};
+            }
+            else
+            {
+                row[col] = {0, 0, 255};
+            }
+        }
+    }
+}
+
+//***************************************************************************************************//
+//                                      ON DISK RESULT CACHE                                         //
+//***************************************************************************************************//
+
+// Size limit of the result cache unless --cache-size is given
+const long long DEFAULT_CACHE_BYTES = 1LL << 30;
+
+// Multipliers of the 64 bit file hash (the xxHash64 primes)
+const uint64_t HASH_PRIME_1 = 11400714785074694791ULL;
+const uint64_t HASH_PRIME_2 = 14029467366897019727ULL;
+const uint64_t HASH_PRIME_3 = 1609587929392839161ULL;
+const uint64_t HASH_PRIME_4 = 9650029242287828579ULL;
+const uint64_t HASH_PRIME_5 = 2870177450012600261ULL;
+
+/**
+ * Rotates a 64 bit value left. Helper function for hash_file()
+ */
+uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/**
+ * Mixes one 8 byte word into a hash lane. Helper function for hash_file()
+ */
+uint64_t hash_round(uint64_t lane, uint64_t word)
+{
+    return rotate_left(lane + word * HASH_PRIME_2, 31) * HASH_PRIME_1;
+}
+
+/**
+ * Hashes the contents of a file with xxHash64 (seed 0), reading it in large
+ * chunks and mixing four 8 byte lanes at a time.
+ * @param filename the file
+ * @param hash     set to the hash
+ * @return True if the file was read and false otherwise
+ */
+bool hash_file(string filename, uint64_t& hash)
+{
+    ifstream stream(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    // Chunk size is a multiple of the 32 bytes the lanes take per round
+    const int CHUNK_BYTES = 1 << 20;
+    vector<char> chunk(CHUNK_BYTES);
+    uint64_t lanes[4] = {HASH_PRIME_1 + HASH_PRIME_2, HASH_PRIME_2, 0, 0 - HASH_PRIME_1};
+    uint64_t total = 0;
+    string tail;
+
+    while (stream)
+    {
+        stream.read(chunk.data(), CHUNK_BYTES);
+        size_t count = stream.gcount();
+        size_t i = 0;
+        for (; i + 32 <= count; i += 32)
+        {
+            for (int lane = 0; lane < 4; lane++)
+            {
+                uint64_t word;
+                memcpy(&word, chunk.data() + i + 8 * lane, 8);
+                lanes[lane] = hash_round(lanes[lane], word);
+            }
+        }
+        total = total + count;
+        tail.assign(chunk.data() + i, count - i);
+    }
+
+    // Merge the lanes, as xxHash64 does for inputs of 32 bytes or more
+    if (total >= 32)
+    {
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            hash = (hash ^ hash_round(0, lanes[lane])) * HASH_PRIME_1 + HASH_PRIME_4;
+        }
+    }
+    else
+    {
+        hash = HASH_PRIME_5;
+    }
+    hash = hash + total;
+
+    // Mix in the bytes left over from the last 32 byte round
+    size_t i = 0;
+    for (; i + 8 <= tail.size(); i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, tail.data() + i, 8);
+        hash = rotate_left(hash ^ hash_round(0, word), 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if (i + 4 <= tail.size())
+    {
+        uint32_t word;
+        memcpy(&word, tail.data() + i, 4);
+        hash = rotate_left(hash ^ (word * HASH_PRIME_1), 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        i = i + 4;
+    }
+    for (; i < tail.size(); i++)
+    {
+        hash = rotate_left(hash ^ ((unsigned char)tail[i] * HASH_PRIME_5), 11) * HASH_PRIME_1;
+    }
+
+    hash = (hash ^ (hash >> 33)) * HASH_PRIME_2;
+    hash = (hash ^ (hash >> 29)) * HASH_PRIME_3;
+    hash = hash ^ (hash >> 32);
+    return true;
+}
+
+/**
+ * Makes the cache file name of a result
+ * @param input_hash hash of the input file, see hash_file()
+ * @param number     the process number
+ * @param params     the process parameters
+ * @param format     the output format
+ * @return the file name inside the cache directory
+ */
+string cache_key(uint64_t input_hash, int number, const vector<double>& params, string format)
+{
+    // Same operation and parameters give the same text
+    string operation = to_string(number);
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        char param[32];
+        snprintf(param, sizeof(param), ":%.17g", params[i]);
+        operation += param;
+    }
+
+    uint64_t operation_hash = HASH_PRIME_5;
+    for (size_t i = 0; i < operation.size(); i++)
+    {
+        operation_hash = (operation_hash ^ (unsigned char)operation[i]) * HASH_PRIME_1;
+    }
+
+    char key[64];
+    snprintf(key, sizeof(key), "%016llx%016llx.", (unsigned long long)input_hash, (unsigned long long)operation_hash);
+    return key + format;
+}
+
+/**
+ * Copies the contents of a file into a new file that has the usual
+ * permissions. Clones the data when the file system supports it (e.g.
+ * Btrfs or XFS), so large results cost no extra space or time.
+ * Helper function for cache_fetch()
+ * @param from the file to copy
+ * @param to   the new file
+ * @return True if the file was copied and false otherwise
+ */
+bool copy_contents(string from, string to)
+{
+    int source = open(from.c_str(), O_RDONLY);
+    if (source < 0)
+    {
+        return false;
+    }
+    int target = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (target < 0)
+    {
+        close(source);
+        return false;
+    }
+
+    bool cloned = false;
+#ifdef FICLONE
+    cloned = ioctl(target, FICLONE, source) == 0;
+#endif
+    close(source);
+    if (close(target) != 0)
+    {
+        return false;
+    }
+    if (cloned)
+    {
+        return true;
+    }
+
+    ifstream in_file(from, ios::in | ios::binary);
+    ofstream out_file(to, ios::out | ios::binary | ios::trunc);
+    out_file << in_file.rdbuf();
+    out_file.close();
+    return in_file.is_open() && !out_file.fail();
+}
+
+/**
+ * Serves a cached result by copying it to the output, so later writes to
+ * the output never reach the cache. The copy replaces the output only once
+ * complete. Marks the entry as recently used.
+ * @param cache_dir the cache directory
+ * @param key       the cache file name from cache_key()
+ * @param output    the output file name
+ * @return True on a cache hit and false otherwise
+ */
+bool cache_fetch(string cache_dir, string key, string output)
+{
+    filesystem::path entry = filesystem::path(cache_dir) / key;
+    error_code error;
+    if (!filesystem::is_regular_file(entry, error))
+    {
+        return false;
+    }
+
+    string temporary = output + ".part";
+    if (!copy_contents(entry.string(), temporary))
+    {
+        filesystem::remove(temporary, error);
+        return false;
+    }
+    filesystem::rename(temporary, output, error);
+    if (error)
+    {
+        filesystem::remove(temporary, error);
+        return false;
+    }
+
+    filesystem::last_write_time(entry, filesystem::file_time_type::clock::now(), error);
+    return true;
+}
+
+/**
+ * Copies a new result into the cache, then removes the least recently used
+ * entries until the cache fits in its size limit.
+ * @param cache_dir the cache directory, created if needed
+ * @param key       the cache file name from cache_key()
+ * @param output    the output file that was just written
+ * @param max_bytes the size limit of the cache
+ */
+void cache_store(string cache_dir, string key, string output, long long max_bytes)
+{
+    error_code error;
+    filesystem::create_directories(cache_dir, error);
+
+    // Copy under a temporary name so readers never see half an entry
+    filesystem::path entry = filesystem::path(cache_dir) / key;
+    filesystem::path temporary = entry;
+    temporary += ".tmp" + to_string(getpid());
+    filesystem::copy_file(output, temporary, filesystem::copy_options::overwrite_existing, error);
+    if (error)
+    {
+        return;
+    }
+    // Entries are read only, so nothing can change them through a copy
+    filesystem::permissions(temporary, filesystem::perms::owner_read | filesystem::perms::group_read |
+                                           filesystem::perms::others_read, error);
+    filesystem::rename(temporary, entry, error);
+    if (error)
+    {
+        filesystem::remove(temporary, error);
+        return;
+    }
+
+    // Evict the least recently used entries
+    vector<pair<filesystem::file_time_type, filesystem::path>> entries;
+    long long total = 0;
+    for (const filesystem::directory_entry& file : filesystem::directory_iterator(cache_dir, error))
+    {
+        if (file.is_regular_file(error))
+        {
+            entries.push_back({file.last_write_time(error), file.path()});
+            total = total + file.file_size(error);
+        }
+    }
+    sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() && total > max_bytes; i++)
+    {
+        long long size = filesystem::file_size(entries[i].second, error);
+        if (filesystem::remove(entries[i].second, error))
+        {
+            total = total - size;
+        }
+    }
+}
+
+//***************************************************************************************************//
+//                                   COMMAND LINE (BATCH) MODE                                       //
+//***************************************************************************************************//
+
+/**
+ * Gets the number of parameters a process takes on the command line
+ * @param number the process number
+ * @return the number of parameters, or -1 if there is no such process
+ */
+int process_parameter_count(int number)
+{
+    if (number == 2 || number == 5 || number == 8 || number == 9 || number == 14 || number == 15 || number == 16)
+    {
+        return 1;
+    }
+    else if (number == 6 || number == 11 || number == 12)
+    {
+        return 2;
+    }
+    else if (number == 13)
+    {
+        return 1;
+    }
+    else if (number >= 1 && number <= 17)
+    {
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Checks the parameters of a process
+ * @param number the process number
+ * @param params the parameters, process_parameter_count() of them
+ * @return a message saying what is wrong, or "" if they are fine
+ */
+string parameter_error(int number, const vector<double>& params)
+{
+    if ((number == 6 || number == 11 || number == 12)
+        && !(params[0] >= 1 && params[1] >= 1 && params[0] <= INT_MAX && params[1] <= INT_MAX))
+    {
+        return "scale factors and sizes must be integers from 1 to " + to_string(INT_MAX);
+    }
+    if (number == 14 && !(params[0] > 0 && params[0] <= MAX_BLUR_SIGMA))
+    {
+        return "SIGMA must be > 0 and at most " + to_string((int)MAX_BLUR_SIGMA);
+    }
+    if (number == 16 && isnan(params[0]))
+    {
+        return "AMOUNT must be a number";
+    }
+    if (number == 15 && !(params[0] >= 0 && params[0] <= MAX_BOX_RADIUS))
+    {
+        return "RADIUS must be from 0 to " + to_string(MAX_BOX_RADIUS);
+    }
+    if (number == 13 && params[0] < 1)
+    {
+        return "the pyramid needs LEVELS >= 1";
+    }
+    return "";
+}
+
+// Ways to run a process, from least to most memory
+enum Strategy
+{
+    STREAM_ROWS,    // Each input row goes straight to the output, no image is held
+    SCATTER_ROWS,   // Input rows are placed into the output image as they arrive
+    WHOLE_IMAGE     // The whole input image is read, then processed into a new image
+};
+
+/**
+ * Gets the name of a strategy for messages
+ * @param strategy the strategy
+ * @return the name
+ */
+string strategy_name(Strategy strategy)
+{
+    if (strategy == STREAM_ROWS)
+    {
+        return "streaming rows";
+    }
+    else if (strategy == SCATTER_ROWS)
+    {
+        return "output image only";
+    }
+    return "whole image";
+}
+
+/**
+ * Gets the number of 90 degree clockwise turns of a rotation process, as
+ * process_5() gives them: any negative count that is not a whole number of
+ * full turns (e.g. -1 or -2) rotates by 270 degrees.
+ * @param number the process number, 4 or 5
+ * @param params the process parameters
+ * @return 0, 1, 2 or 3
+ */
+int quarter_turns(int number, const vector<double>& params)
+{
+    if (number == 4)
+    {
+        return 1;
+    }
+    int turns = (int)params[0] % 4;
+    if (turns < 0)
+    {
+        return 3;
+    }
+    return turns;
+}
+
+/**
+ * Rotates an image by multiples of 90 degrees clockwise in a single pass.
+ * Gives the same image as process_5() without its intermediate images.
+ * @param image the input image
+ * @param turns number of 90 degree turns, 0 to 3
+ * @return the new image
+ */
+Image rotate_image(const Image& image, int turns)
+{
+    int num_rows = image.size();       // HEIGHT
+    int num_columns = image[0].size(); // WIDTH
+    if (turns == 0)
+    {
+        return image;
+    }
+
+    Image new_image = turns == 2 ? make_image(num_columns, num_rows) : make_image(num_rows, num_columns);
+    for (int row = 0; row < num_rows && !job_cancelled(); row++)
+    {
+        for (int col = 0; col < num_columns; col++)
+        {
+            if (turns == 1)
+            {
+                new_image[col][num_rows - row - 1] = image[row][col];
+            }
+            else if (turns == 2)
+            {
+                new_image[num_rows - row - 1][num_columns - col - 1] = image[row][col];
+            }
+            else
+            {
+                new_image[num_columns - col - 1][row] = image[row][col];
+            }
+        }
+    }
+    return new_image;
+}
+
+/**
+ * Scales an image up by whole numbers, building each output row once and
+ * copying it to the rows below. Gives the same image as process_6().
+ * @param image   the input image
+ * @param x_scale output pixels per input pixel across
+ * @param y_scale output pixels per input pixel down
+ * @return the new image
+ */
+Image enlarge_image(const Image& image, int x_scale, int y_scale)
+{
+    int num_rows = image.size();       // HEIGHT
+    int num_columns = image[0].size(); // WIDTH
+
+    Image new_image = make_image(num_columns * x_scale, num_rows * y_scale);
+    for (int row = 0; row < num_rows && !job_cancelled(); row++)
+    {
+        PixelRow& first = new_image[row * y_scale];
+        for (int col = 0; col < num_columns; col++)
+        {
+            fill_n(first.begin() + col * x_scale, x_scale, image[row][col]);
+        }
+        for (int copy_row = 1; copy_row < y_scale; copy_row++)
+        {
+            copy(first.begin(), first.end(), new_image[row * y_scale + copy_row].begin());
+        }
+    }
+    return new_image;
+}
+
+/**
+ * Gets the size of the image a process makes, in 64 bits so enlarging
+ * can't overflow
+ * @param number     the process number
+ * @param params     the process parameters
+ * @param width      WIDTH of the input
+ * @param height     HEIGHT of the input
+ * @param new_width  set to the WIDTH of the output
+ * @param new_height set to the HEIGHT of the output
+ */
+void output_size(int number, const vector<double>& params, int width, int height, long long& new_width,
+                 long long& new_height)
+{
+    new_width = width;
+    new_height = height;
+    if ((number == 4 || number == 5) && quarter_turns(number, params) % 2 == 1)
+    {
+        new_width = height;
+        new_height = width;
+    }
+    else if (number == 6)
+    {
+        new_width = (long long)width * (int)params[0];
+        new_height = (long long)height * (int)params[1];
+    }
+    else if (number == 11)
+    {
+        new_width = (width + (int)params[0] - 1) / (int)params[0];
+        new_height = (height + (int)params[1] - 1) / (int)params[1];
+    }
+    else if (number == 12)
+    {
+        new_width = params[0];
+        new_height = params[1];
+    }
+}
+
+/**
+ * Gets the bytes counted for an image of the given size, the way the
+ * allocator counts them: a huge page block of carved rows, or rows with
+ * their own headers, plus the row vectors themselves
+ * @param width  WIDTH in pixels
+ * @param height HEIGHT in pixels
+ * @return the bytes
+ */
+long long image_buffer_bytes(long long width, long long height)
+{
+    long long bytes = counted_bytes(height * (long long)sizeof(PixelRow));
+    long long block = row_block_bytes(width, height);
+    if (block > 0)
+    {
+        return bytes + whole_huge_pages(block);
+    }
+    return bytes + height * counted_bytes(width * (long long)sizeof(Pixel));
+}
+
+/**
+ * Checks if a process makes each output row from input rows that arrive
+ * together, so it can run on rows as they stream in
+ * @param number the process number
+ * @return True for the point processes, enlarging and shrinking
+ */
+bool is_row_process(int number)
+{
+    return is_point_process(number) || number == 6 || number == 11;
+}
+
+/**
+ * Checks if a process can run with a strategy
+ * @param strategy the strategy
+ * @param number   the process number
+ * @param in_info  the input properties
+ * @param out_info the output properties
+ * @param region   the region of interest, width 0 for the whole image
+ * @return True if the strategy works for the process and false otherwise
+ */
+bool strategy_available(Strategy strategy, int number, const ImageInfo& in_info, const ImageInfo& out_info,
+                        Region region)
+{
+    if (region.width > 0 && strategy != WHOLE_IMAGE)
+    {
+        return is_point_process(number) && (strategy == SCATTER_ROWS || in_info.bottom_up == out_info.bottom_up);
+    }
+    if (strategy == STREAM_ROWS)
+    {
+        return is_row_process(number) && in_info.bottom_up == out_info.bottom_up;
+    }
+    else if (strategy == SCATTER_ROWS)
+    {
+        return is_row_process(number) || number == 4 || number == 5;
+    }
+    return true;
+}
+
+/**
+ * Estimates the most image buffer bytes a process holds at once
+ * @param strategy the strategy
+ * @param number   the process number
+ * @param params   the process parameters
+ * @param width    WIDTH of the input
+ * @param height   HEIGHT of the input
+ * @param region   the region of interest, width 0 for the whole image
+ * @return the estimated peak bytes
+ */
+long long estimate_bytes(Strategy strategy, int number, const vector<double>& params, int width, int height,
+                         Region region = {0, 0, 0, 0})
+{
+    long long new_width, new_height;
+    output_size(number, params, width, height, new_width, new_height);
+    long long rows = 3 * image_buffer_bytes(max((long long)width, new_width), 1);
+
+    if (strategy == STREAM_ROWS)
+    {
+        return rows;
+    }
+    else if (strategy == SCATTER_ROWS)
+    {
+        return image_buffer_bytes(new_width, new_height) + rows;
+    }
+
+    // A region is filtered in place, only its own result is extra
+    Region area = clip_region(region, width, height);
+    long long bytes = image_buffer_bytes(width, height) + image_buffer_bytes(new_width, new_height);
+    if (region.width > 0)
+    {
+        bytes = image_buffer_bytes(width, height) + image_buffer_bytes(area.width, area.height);
+    }
+    long long floats = (long long)area.width * area.height * 3 * sizeof(float);
+    long long float_row = (long long)area.width * 3 * sizeof(float);
+    if (number == 14 || number == 16 || number == 17)
+    {
+        // Result floats, plus the row pass band of the convolution
+        int radius = number == 14 ? max(1, (int)ceil(3 * params[0])) : number == 16 ? 3 : 1;
+        long long band_rows = min(max(CONVOLUTION_BAND_ROWS, 4 * radius), area.height);
+        bytes = bytes + counted_bytes(floats) + counted_bytes(min(band_rows + 2LL * radius, (long long)height) * float_row);
+        if (number == 17)
+        {
+            bytes = bytes + counted_bytes(floats);
+        }
+    }
+    else if (number == 15)
+    {
+        // Ring of 64 bit row sums
+        bytes = bytes + counted_bytes(min(2LL * (int)params[0] + 2, (long long)height) * area.width * 3
+                                      * (long long)sizeof(long long));
+    }
+    return bytes;
+}
+
+/**
+ * Formats a number of bytes for messages
+ * @param bytes the number of bytes
+ * @return the size in megabytes, e.g. "12.5 MB"
+ */
+string megabytes(long long bytes)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.1f MB", bytes / (1024.0 * 1024.0));
+    return text;
+}
+
+/**
+ * Picks the fastest strategy that fits in a memory limit. Streaming rows is
+ * preferred, then the whole image (which can use the parallel decoder), then
+ * holding only the output image.
+ * @param number    the process number
+ * @param params    the process parameters
+ * @param in_info   the input properties
+ * @param out_info  the output properties
+ * @param region    the region of interest, width 0 for the whole image
+ * @param limit     the memory limit in bytes, 0 for no limit
+ * @param strategy  set to the chosen strategy, or the leanest one if none fits
+ * @return True if some strategy fits and false otherwise
+ */
+bool choose_strategy(int number, const vector<double>& params, const ImageInfo& in_info, const ImageInfo& out_info,
+                     Region region, long long limit, Strategy& strategy)
+{
+    Strategy order[3] = {STREAM_ROWS, WHOLE_IMAGE, SCATTER_ROWS};
+    for (int i = 0; i < 3; i++)
+    {
+        if (strategy_available(order[i], number, in_info, out_info, region)
+            && (limit <= 0 || estimate_bytes(order[i], number, params, in_info.width, in_info.height, region) <= limit))
+        {
+            strategy = order[i];
+            return true;
+        }
+    }
+
+    strategy = strategy_available(SCATTER_ROWS, number, in_info, out_info, region) ? SCATTER_ROWS : WHOLE_IMAGE;
+    return false;
+}
+
+/**
+ * Applies a process to a whole image
+ * @param image  the input image
+ * @param number the process number
+ * @param params the process parameters, see process_parameter_count()
+ * @return the new image, or an empty vector if there is no such process
+ */
+Image apply_process(const Image& image, int number, const vector<double>& params)
+{
+    switch (number)
+    {
+        case 1:  return process_1(image);
+        case 2:  return process_2(image, params[0]);
+        case 3:  return process_3(image);
+        case 4:  return rotate_image(image, 1);
+        case 5:  return rotate_image(image, quarter_turns(5, params));
+        case 6:  return enlarge_image(image, params[0], params[1]);
+        case 7:  return process_7(image);
+        case 8:  return process_8(image, params[0]);
+        case 9:  return process_9(image, params[0]);
+        case 10: return process_10(image);
+        case 11: return process_11(image, params[0], params[1]);
+        case 12: return process_12(image, params[0], params[1]);
+        case 14: return process_14(image, params[0]);
+        case 15: return process_15(image, params[0]);
+        case 16: return process_16(image, params[0]);
+        case 17: return process_17(image);
+        default:
+            cerr << "Error: process " << number << " can't be applied to a whole image\n";
+            return {};
+    }
+}
+
+/**
+ * Checks if a process can be limited to a region of interest
+ * @param number the process number
+ * @return True for the point processes and the convolution filters
+ */
+bool supports_region(int number)
+{
+    return is_point_process(number) || (number >= 14 && number <= 17);
+}
+
+/**
+ * Applies a filter to a region of an image in place. Pixels outside the
+ * region are neither processed nor copied.
+ * @param image  the image to change
+ * @param number the process number, see supports_region()
+ * @param params the process parameters
+ * @param region the region of interest, see clip_region()
+ * @return True if successful, false if the process does not work on a region
+ */
+bool apply_process_region(Image& image, int number, const vector<double>& params, Region region)
+{
+    Region area = clip_region(region, image[0].size(), image.size());
+
+    // Point processes work on the region rows where they are
+    if (is_point_process(number))
+    {
+        double scaling_factor = params.empty() ? 0 : params[0];
+        for (int row = 0; row < area.height && !job_cancelled(); row++)
+        {
+            process_row(&image[area.y + row][area.x], area.width, row, area.height, number, scaling_factor);
+        }
+        return true;
+    }
+
+    // Filters read the neighbours around the region, so the result is made first
+    Image result;
+    switch (number)
+    {
+        case 14: result = process_14(image, params[0], area); break;
+        case 15: result = process_15(image, params[0], area); break;
+        case 16: result = process_16(image, params[0], area); break;
+        case 17: result = process_17(image, area); break;
+        default: return false;
+    }
+    for (int row = 0; row < area.height; row++)
+    {
+        copy(result[row].begin(), result[row].end(), image[area.y + row].begin() + area.x);
+    }
+    return true;
+}
+
+/**
+ * Reads only a region of an image. BMP files go through the parallel
+ * decoder, which reads just the region's rows. Streams are read up to the
+ * last row of the region, skipping the rows before it without decoding them.
+ * @param in      the input stream, positioned after the header
+ * @param in_info the input properties from read_header()
+ * @param input   the input file name, or "-" for stdin
+ * @param threads number of decoding threads, 0 for one per hardware thread
+ * @param region  the region to read, see clip_region()
+ * @return the region as an image, empty if it could not be read
+ */
+Image read_region(istream& in, const ImageInfo& in_info, string input, int threads, Region region)
+{
+    Region area = clip_region(region, in_info.width, in_info.height);
+    if (area.width == 0 || area.height == 0)
+    {
+        return {};
+    }
+    if (in_info.format == "bmp" && input != "-")
+    {
+        Image image = read_image_parallel(input, threads, area);
+        if (!image.empty())
+        {
+            return image;
+        }
+    }
+
+    // Files the parallel decoder turns down are read from the stream instead
+
+    // Rows in stream order, BMP streams start at the bottom
+    int first = in_info.bottom_up ? in_info.height - area.y - area.height : area.y;
+    long long row_bytes = (long long)in_info.width * in_info.bytes_per_pixel + in_info.padding;
+    in.ignore(first * row_bytes);
+
+    Image image = make_image(area.width, area.height);
+    PixelRow row(in_info.width);
+    vector<unsigned char> bytes;
+    for (int i = first; i < first + area.height; i++)
+    {
+        if (!read_row(in, in_info, row, bytes))
+        {
+            return {};
+        }
+        int row_index = in_info.bottom_up ? in_info.height - 1 - i : i;
+        copy(row.begin() + area.x, row.begin() + area.x + area.width, image[row_index - area.y].begin());
+    }
+    return image;
+}
+
+/**
+ * Applies a process to an input stream and writes the result to an output
+ * stream, using the given strategy. Rows are read as they arrive for
+ * STREAM_ROWS and SCATTER_ROWS. WHOLE_IMAGE uses the parallel decoder when
+ * the input is a BMP file.
+ * @param in         the input stream, positioned after the header
+ * @param in_info    the input properties from read_header()
+ * @param input      the input file name, or "-" for stdin
+ * @param threads    number of decoding threads, 0 for one per hardware thread
+ * @param out        the output stream
+ * @param out_format "bmp", "ppm" or "pam"
+ * @param number     the process number
+ * @param params     the process parameters
+ * @param strategy   the strategy from choose_strategy()
+ * @param region     the region of interest, width 0 for the whole image
+ * @return True if successful and false otherwise
+ */
+bool stream_process(istream& in, const ImageInfo& in_info, string input, int threads, ostream& out,
+                    string out_format, int number, const vector<double>& params, Strategy strategy,
+                    Region region = {0, 0, 0, 0})
+{
+    if (strategy == WHOLE_IMAGE)
+    {
+        Image image;
+        if (in_info.format == "bmp" && input != "-")
+        {
+            image = read_image_parallel(input, threads);
+        }
+        // Files the parallel decoder turns down are read from the stream instead
+        if (image.empty())
+        {
+            image = read_rows(in, in_info);
+        }
+        if (image.empty())
+        {
+            return false;
+        }
+
+        bool success;
+        if (region.width > 0)
+        {
+            success = apply_process_region(image, number, params, region) && write_rows(out, out_format, image);
+        }
+        else
+        {
+            success = write_rows(out, out_format, apply_process(image, number, params));
+        }
+        out.flush();
+        return success;
+    }
+
+    // Set variables
+
+    int num_rows = in_info.height;       // HEIGHT
+    int num_columns = in_info.width;     // WIDTH
+    long long new_width, new_height;
+    output_size(number, params, num_columns, num_rows, new_width, new_height);
+    ImageInfo out_info = make_output_info(out_format, new_width, new_height);
+    double scaling_factor = params.empty() ? 0 : params[0];
+    int x_scale = number == 6 || number == 11 ? params[0] : 1;
+    int y_scale = number == 6 || number == 11 ? params[1] : 1;
+    int turns = number == 4 || number == 5 ? quarter_turns(number, params) : 0;
+    Region area = clip_region(region, num_columns, num_rows);
+
+    // Output rows either go straight out or into the output image
+
+    Image new_image;
+    vector<unsigned char> in_bytes, out_bytes;
+    if (strategy == SCATTER_ROWS)
+    {
+        new_image = make_image(new_width, new_height);
+    }
+    else
+    {
+        write_header(out, out_info);
+    }
+    auto emit_row = [&](int new_row, const PixelRow& row)
+    {
+        if (strategy == SCATTER_ROWS)
+        {
+            new_image[new_row] = row;
+        }
+        else
+        {
+            write_row(out, out_info, row, out_bytes);
+        }
+    };
+
+    PixelRow row(num_columns);
+    PixelRow new_row(number == 6 ? new_width : 0);
+    vector<long long> sums(number == 11 ? num_columns * 3 : 0, 0);
+    int summed = 0;
+
+    for (int i = 0; i < num_rows; i++)
+    {
+        if (!read_row(in, in_info, row, in_bytes))
+        {
+            return false;
+        }
+        int row_index = in_info.bottom_up ? num_rows - 1 - i : i;
+
+        if (is_point_process(number))
+        {
+            // Rows outside the region of interest pass through as they are
+            if (row_index >= area.y && row_index < area.y + area.height)
+            {
+                process_row(&row[area.x], area.width, row_index - area.y, area.height, number, scaling_factor);
+            }
+            emit_row(row_index, row);
+        }
+        else if (number == 6)
+        {
+            // Same as process_6(), every row and column repeated
+            for (int col = 0; col < new_width; col++)
+            {
+                new_row[col] = row[col / x_scale];
+            }
+            for (int j = 0; j < y_scale; j++)
+            {
+                emit_row(row_index * y_scale + j, new_row);
+            }
+        }
+        else if (number == 11)
+        {
+            // Same as process_11(), a block ends when the next row is in another one
+            add_row(sums, row);
+            summed++;
+            int next_index = in_info.bottom_up ? row_index - 1 : row_index + 1;
+            if (next_index < 0 || next_index >= num_rows || next_index / y_scale != row_index / y_scale)
+            {
+                emit_row(row_index / y_scale, average_columns(sums, num_columns, x_scale, summed));
+                fill(sums.begin(), sums.end(), 0);
+                summed = 0;
+            }
+        }
+        else
+        {
+            // Same as rotate_image(), one input row at a time
+            for (int col = 0; col < num_columns; col++)
+            {
+                if (turns == 0)
+                {
+                    new_image[row_index][col] = row[col];
+                }
+                else if (turns == 1)
+                {
+                    new_image[col][num_rows - row_index - 1] = row[col];
+                }
+                else if (turns == 2)
+                {
+                    new_image[num_rows - row_index - 1][num_columns - col - 1] = row[col];
+                }
+                else
+                {
+                    new_image[num_columns - col - 1][row_index] = row[col];
+                }
+            }
+        }
+    }
+
+    if (strategy == SCATTER_ROWS)
+    {
+        write_rows(out, out_format, new_image);
+    }
+    out.flush();
+    return out.good();
+}
+
+/**
+ * Applies a process to a cropped part of the input and writes only that part.
+ * Rows outside the crop are not decoded, see read_region().
+ * @param in      the input stream, positioned after the header
+ * @param in_info the input properties from read_header()
+ * @param input   the input file name, or "-" for stdin
+ * @param threads number of decoding threads, 0 for one per hardware thread
+ * @param out     the output stream
+ * @param format  "bmp", "ppm" or "pam"
+ * @param number  the process number
+ * @param params  the process parameters
+ * @param crop    the part of the input to keep
+ * @param region  the region of interest inside the crop, width 0 for all of it
+ * @return True if successful and false otherwise
+ */
+bool crop_process(istream& in, const ImageInfo& in_info, string input, int threads, ostream& out, string format,
+                  int number, const vector<double>& params, Region crop, Region region)
+{
+    Image image = read_region(in, in_info, input, threads, crop);
+    if (image.empty())
+    {
+        return false;
+    }
+
+    bool success;
+    if (region.width > 0)
+    {
+        success = apply_process_region(image, number, params, region) && write_rows(out, format, image);
+    }
+    else
+    {
+        success = write_rows(out, format, apply_process(image, number, params));
+    }
+    out.flush();
+    return success;
+}
+
+/**
+ * Writes the levels of a thumbnail pyramid, see pyramid_filename()
+ * @param levels the levels from the largest down, rows top first
+ * @param output the output file name of the largest level
+ * @param format the output format
+ * @return True if all levels were written and false otherwise
+ */
+bool write_pyramid(const vector<Image>& levels, string output, string format)
+{
+    for (int level = 0; level < (int)levels.size(); level++)
+    {
+        string filename = pyramid_filename(output, level);
+        ofstream stream(filename, ios::out | ios::binary);
+        if (!stream.is_open() || !write_rows(stream, format, levels[level]))
+        {
+            return false;
+        }
+        cerr << "Wrote " << filename << "\n";
+    }
+    return true;
+}
+
+/**
+ * Builds a thumbnail pyramid from an input stream one row at a time.
+ * Gives the same levels as process_13() in any row order.
+ * @param in             the input stream, positioned after the header
+ * @param in_info        the input properties from read_header()
+ * @param levels         the number of levels
+ * @param pyramid_levels set to the levels, rows top first
+ * @return True if successful and false otherwise
+ */
+bool stream_pyramid(istream& in, const ImageInfo& in_info, int levels, vector<Image>& pyramid_levels)
+{
+    Pyramid pyramid = make_pyramid(in_info.width, in_info.height, levels, in_info.bottom_up);
+    PixelRow row(in_info.width);
+    vector<unsigned char> bytes;
+    for (int i = 0; i < in_info.height; i++)
+    {
+        if (!read_row(in, in_info, row, bytes))
+        {
+            return false;
+        }
+        pyramid_add_row(pyramid, row);
+    }
+    pyramid_finish(pyramid);
+
+    // BMP rows arrived bottom first
+    if (in_info.bottom_up)
+    {
+        for (int level = 0; level < (int)pyramid.levels.size(); level++)
+        {
+            reverse(pyramid.levels[level].begin(), pyramid.levels[level].end());
+        }
+    }
+    pyramid_levels.swap(pyramid.levels);
+    return true;
+}
+
+/**
+ * Gets the output format from a file name extension
+ * @param filename the output file name
+ * @return "bmp", "ppm" or "pam", or "" if the extension is not known
+ */
+string format_from_filename(string filename)
+{
+    size_t dot = filename.rfind('.');
+    if (dot == string::npos)
+    {
+        return "";
+    }
+    string extension = filename.substr(dot + 1);
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == "bmp" || extension == "ppm" || extension == "pam")
+    {
+        return extension;
+    }
+    return "";
+}
+
+/**
+ * Reads a region from X,Y,W,H text
+ * @param text   the text to read
+ * @param region set to the region
+ * @return True if it has four numbers, a position >= 0 and a size > 0
+ */
+bool parse_region(string text, Region& region)
+{
+    char extra;
+    return sscanf(text.c_str(), "%d,%d,%d,%d%c", &region.x, &region.y, &region.width, &region.height, &extra) == 4
+           && region.x >= 0 && region.y >= 0 && region.width > 0 && region.height > 0;
+}
+
+/**
+ * Prints the command line usage
+ * @param program the program name
+ */
+void print_usage(string program)
+{
+    cerr << "Usage: " << program << " INPUT OUTPUT PROCESS [PARAMETERS...] [--format bmp|ppm|pam]\n";
+    cerr << "       [--cache DIR] [--cache-size MB] [--threads N] [--memory-limit MB] [--memory-stats]\n";
+    cerr << "       [--roi X,Y,W,H] [--crop X,Y,W,H]\n";
+    cerr << "       " << program << " --self-test [ITERATIONS] [SEED]\n\n";
+    cerr << "INPUT and OUTPUT are BMP, PPM (P6) or PAM (P7) files, or - for stdin/stdout.\n";
+    cerr << "The output format comes from --format, then the OUTPUT extension, then the input format.\n";
+    cerr << "--cache keeps results in DIR (default limit 1024 MB) and reuses them for the same\n";
+    cerr << "input file, process and parameters. It needs INPUT and OUTPUT to be files.\n";
+    cerr << "--threads sets the number of threads used to decode BMP files (default: all cores).\n";
+    cerr << "--memory-limit picks a way of running the process that keeps image buffers under MB,\n";
+    cerr << "or refuses to start if there is none. --memory-stats prints the peak image memory.\n";
+    cerr << "--roi only changes the W by H pixels at X,Y and copies the rest (processes 1-3, 7-10, 14-17).\n";
+    cerr << "--crop only reads and outputs the W by H pixels at X,Y. With both, the --roi is inside the crop.\n";
+    cerr << "--self-test checks the fast code paths against the original functions on random images.\n\n";
+    cerr << "Processes:\n";
+    cerr << "  1             Vignette\n";
+    cerr << "  2 FACTOR      Clarendon\n";
+    cerr << "  3             Grayscale\n";
+    cerr << "  4             Rotate by 90 degrees clockwise\n";
+    cerr << "  5 COUNT       Rotate by multiple 90 degrees\n";
+    cerr << "  6 X Y         Enlarge in x and y direction\n";
+    cerr << "  7             High contrast black and white\n";
+    cerr << "  8 FACTOR      Lighten by scaling factor\n";
+    cerr << "  9 FACTOR      Darken by scaling factor\n";
+    cerr << "  10            Convert to black, white, red, blue, green only\n";
+    cerr << "  11 X Y        Shrink by area averaging X by Y blocks\n";
+    cerr << "  12 W H        Resize to W by H pixels with bilinear interpolation\n";
+    cerr << "  13 LEVELS     Thumbnail pyramid, writes OUTPUT_2, OUTPUT_4, ... (OUTPUT can't be -)\n";
+    cerr << "  14 SIGMA      Gaussian blur\n";
+    cerr << "  15 RADIUS     Box blur (same speed for any radius)\n";
+    cerr << "  16 AMOUNT     Sharpen\n";
+    cerr << "  17            Edge detection\n";
+}
+
+/**
+ * Runs one process from the command line without the menu.
+ * Messages go to stderr so stdout can carry image data.
+ * @param argc number of arguments
+ * @param argv the arguments
+ * @return the exit code
+ */
+int run_batch(int argc, char* argv[])
+{
+    vector<string> args;
+    string format;
+    string cache_dir;
+    long long cache_bytes = DEFAULT_CACHE_BYTES;
+    int threads = 0;
+    long long memory_limit = 0;
+    bool memory_stats = false;
+    Region roi = {0, 0, 0, 0};
+    Region crop = {0, 0, 0, 0};
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--format" && i + 1 < argc)
+        {
+            format = argv[++i];
+        }
+        else if (arg == "--cache" && i + 1 < argc)
+        {
+            cache_dir = argv[++i];
+        }
+        else if (arg == "--cache-size" && i + 1 < argc)
+        {
+            cache_bytes = atof(argv[++i]) * 1024 * 1024;
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+            image_threads = threads;
+        }
+        else if (arg == "--memory-limit" && i + 1 < argc)
+        {
+            memory_limit = atof(argv[++i]) * 1024 * 1024;
+        }
+        else if (arg == "--memory-stats")
+        {
+            memory_stats = true;
+        }
+        else if ((arg == "--roi" || arg == "--crop") && i + 1 < argc)
+        {
+            if (!parse_region(argv[++i], arg == "--roi" ? roi : crop))
+            {
+                cerr << "Error: " << arg << " needs X,Y,W,H with X,Y >= 0 and W,H >= 1\n";
+                return 1;
+            }
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
+    if (args.size() < 3)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    string input = args[0];
+    string output = args[1];
+    int number = atoi(args[2].c_str());
+    vector<double> params;
+    for (size_t i = 3; i < args.size(); i++)
+    {
+        params.push_back(atof(args[i].c_str()));
+    }
+
+    if (process_parameter_count(number) < 0 || (int)params.size() != process_parameter_count(number))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (parameter_error(number, params) != "")
+    {
+        cerr << "Error: " << parameter_error(number, params) << "\n";
+        return 1;
+    }
+    if (number == 13 && (params[0] < 1 || output == "-"))
+    {
+        cerr << "Error: the pyramid needs LEVELS >= 1 and an output file name\n";
+        return 1;
+    }
+    if (roi.width > 0 && !supports_region(number))
+    {
+        cerr << "Error: process " << number << " changes the image size and can't use --roi, try --crop\n";
+        return 1;
+    }
+    if (format != "" && format != "bmp" && format != "ppm" && format != "pam")
+    {
+        cerr << "Error: unknown format " << format << "\n";
+        return 1;
+    }
+
+    // Open the input
+    ifstream in_file;
+    istream* in = &cin;
+    if (input != "-")
+    {
+        in_file.open(input, ios::in | ios::binary);
+        if (!in_file.is_open())
+        {
+            cerr << "Error: could not open " << input << "\n";
+            return 1;
+        }
+        in = &in_file;
+    }
+
+    ImageInfo in_info;
+    if (!read_header(*in, in_info))
+    {
+        cerr << "Error: " << input << " is not a supported BMP, PPM or PAM image\n";
+        return 1;
+    }
+
+    if (format == "")
+    {
+        format = output == "-" ? "" : format_from_filename(output);
+    }
+    if (format == "")
+    {
+        format = in_info.format;
+    }
+
+    // Regions must overlap the image, the --roi is inside the crop
+    bool outside = false;
+    int width = in_info.width;
+    int height = in_info.height;
+    if (crop.width > 0)
+    {
+        crop = clip_region(crop, width, height);
+        outside = crop.width == 0 || crop.height == 0;
+        width = crop.width;
+        height = crop.height;
+    }
+    if (roi.width > 0 && !outside)
+    {
+        roi = clip_region(roi, width, height);
+        outside = roi.width == 0 || roi.height == 0;
+    }
+    if (outside)
+    {
+        cerr << "Error: the region is outside the " << in_info.width << " by " << in_info.height << " image\n";
+        return 1;
+    }
+
+    // Refuse outputs too big to describe before any memory is taken
+    long long new_width, new_height;
+    output_size(number, params, width, height, new_width, new_height);
+    if (new_width > INT_MAX || new_height > INT_MAX)
+    {
+        cerr << "Error: process " << number << " would make a " << new_width << " by " << new_height
+             << " image, more than " << INT_MAX << " pixels a side\n";
+        return 1;
+    }
+
+    // Check the memory needed before doing any work
+    Strategy strategy = WHOLE_IMAGE;
+    long long estimate = 0;
+    if (number == 13 && crop.width > 0)
+    {
+        // The cropped input and its levels
+        estimate = image_buffer_bytes(width, height) * 4 / 3;
+    }
+    else if (number == 13)
+    {
+        // The pyramid levels add up to a third of the input
+        estimate = image_buffer_bytes(in_info.width, in_info.height) / 3 + 3 * image_buffer_bytes(in_info.width, 1);
+        strategy = STREAM_ROWS;
+    }
+    else if (crop.width > 0)
+    {
+        estimate = estimate_bytes(WHOLE_IMAGE, number, params, width, height, roi);
+    }
+    else
+    {
+        ImageInfo out_info = make_output_info(format, new_width, new_height);
+        choose_strategy(number, params, in_info, out_info, roi, memory_limit, strategy);
+        estimate = estimate_bytes(strategy, number, params, in_info.width, in_info.height, roi);
+    }
+    if (memory_limit > 0 && estimate > memory_limit)
+    {
+        cerr << "Error: process " << number << " needs about " << megabytes(estimate)
+             << " of image memory, more than the --memory-limit of " << megabytes(memory_limit) << "\n";
+        return 1;
+    }
+
+    if (number == 13 && crop.width > 0)
+    {
+        Image image = read_region(*in, in_info, input, threads, crop);
+        if (image.empty() || !write_pyramid(process_13(image, params[0]), output, format))
+        {
+            cerr << "Error: could not build the pyramid for " << input << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    else if (number == 13)
+    {
+        vector<Image> levels;
+        if (!stream_pyramid(*in, in_info, params[0], levels) || !write_pyramid(levels, output, format))
+        {
+            cerr << "Error: could not build the pyramid for " << input << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    // Serve repeated work from the cache
+    string key;
+    bool use_cache = cache_dir != "" && input != "-" && output != "-";
+    uint64_t input_hash;
+    if (use_cache && hash_file(input, input_hash))
+    {
+        // Regions are part of the operation, the parameter count keeps keys apart
+        vector<double> key_params = params;
+        if (roi.width > 0 || crop.width > 0)
+        {
+            Region regions[2] = {roi, crop};
+            for (int i = 0; i < 2; i++)
+            {
+                key_params.insert(key_params.end(), {(double)regions[i].x, (double)regions[i].y,
+                                                     (double)regions[i].width, (double)regions[i].height});
+            }
+        }
+        key = cache_key(input_hash, number, key_params, format);
+        if (cache_fetch(cache_dir, key, output))
+        {
+            cerr << "Cache hit, " << output << " served from " << cache_dir << "\n";
+            return 0;
+        }
+    }
+
+    // Write to a temporary file that replaces the output once complete, so
+    // INPUT can be OUTPUT and a failed run never leaves a partial file
+    string temporary = output + ".part";
+    ofstream out_file;
+    ostream* out = &cout;
+    if (output != "-")
+    {
+        out_file.open(temporary, ios::out | ios::binary);
+        if (!out_file.is_open())
+        {
+            cerr << "Error: could not open " << output << "\n";
+            return 1;
+        }
+        out = &out_file;
+    }
+
+    bool success = false;
+    try
+    {
+        if (crop.width > 0)
+        {
+            success = crop_process(*in, in_info, input, threads, *out, format, number, params, crop, roi);
+        }
+        else
+        {
+            success = stream_process(*in, in_info, input, threads, *out, format, number, params, strategy, roi);
+        }
+        if (!success)
+        {
+            cerr << "Error: could not process " << input << "\n";
+        }
+    }
+    catch (const bad_alloc&)
+    {
+        cerr << "Error: out of memory processing " << input << "\n";
+    }
+    catch (const length_error&)
+    {
+        cerr << "Error: an image of process " << number << " is too big for memory\n";
+    }
+
+    if (output != "-")
+    {
+        out_file.close();
+        error_code error;
+        if (success && !out_file)
+        {
+            cerr << "Error: could not write " << temporary << "\n";
+            success = false;
+        }
+        if (success)
+        {
+            filesystem::rename(temporary, output, error);
+            if (error)
+            {
+                cerr << "Error: could not replace " << output << "\n";
+                success = false;
+            }
+        }
+        if (!success)
+        {
+            filesystem::remove(temporary, error);
+        }
+    }
+    if (!success)
+    {
+        return 1;
+    }
+
+    if (memory_stats)
+    {
+        cerr << "Strategy: " << strategy_name(strategy) << ", estimated image memory: " << megabytes(estimate)
+             << ", peak image memory: " << megabytes(image_bytes_peak) << "\n";
+    }
+
+    if (key != "")
+    {
+        cache_store(cache_dir, key, output, cache_bytes);
+    }
+    return 0;
+}
+
+//***************************************************************************************************//
+//                          PROGRESSIVE PREVIEW AND BACKGROUND JOBS                                  //
+//***************************************************************************************************//
+
+// Longest side of a preview in pixels
+const int PREVIEW_SIZE = 512;
+
+// Where a background job is
+enum JobState
+{
+    JOB_NONE,       // No job was started
+    JOB_RUNNING,    // Reading, processing or writing
+    JOB_DONE,       // The output file was written
+    JOB_CANCELLED,  // Stopped before the output file was written
+    JOB_FAILED      // The input could not be read or the output written
+};
+
+// What a background job's thread shares with the menu. A cancelled thread
+// keeps its own while it winds down, so the menu can start a new job.
+// The flag is checked by the decoder and the row loops of the processes.
+struct JobProgress
+{
+    atomic<bool> cancel{false};
+    atomic<int> state{JOB_NONE};
+};
+
+// A full resolution process running on its own thread while the menu goes on
+struct BackgroundJob
+{
+    thread worker;
+    vector<thread> stopping;    // Cancelled jobs still winding down
+    shared_ptr<JobProgress> progress = make_shared<JobProgress>();
+    string output;              // The file the job makes
+    int runs = 0;               // Jobs started, keeps their temporary files apart
+};
+
+/**
+ * Reads a smaller copy of an image by decoding only every step-th row and
+ * column. Rows that are not needed are seeked over and never read, so the
+ * copy costs a small part of a full read.
+ * @param filename the BMP, PPM or PAM file
+ * @param max_size the largest WIDTH or HEIGHT of the copy
+ * @param step     set to the number of input pixels per copy pixel
+ * @return the smaller image, empty if the file could not be read
+ */
+Image read_image_subsampled(string filename, int max_size, int& step)
+{
+    ifstream stream(filename, ios::in | ios::binary);
+    ImageInfo info;
+    if (!stream.is_open() || !read_header(stream, info))
+    {
+        return {};
+    }
+
+    // The same step in both directions keeps the aspect ratio
+    step = max(1, (max(info.width, info.height) + max_size - 1) / max_size);
+    int num_columns = (info.width + step - 1) / step;
+    int num_rows = (info.height + step - 1) / step;
+    long long start = stream.tellg();
+    long long row_bytes = (long long)info.width * info.bytes_per_pixel + info.padding;
+
+    Image image(num_rows, PixelRow (num_columns));
+    vector<unsigned char> bytes(row_bytes);
+    for (int row = 0; row < num_rows; row++)
+    {
+        // BMP rows are stored bottom first
+        long long file_row = info.bottom_up ? info.height - 1 - (long long)row * step : (long long)row * step;
+        stream.seekg(start + file_row * row_bytes);
+        if (!stream.read((char*)bytes.data(), row_bytes))
+        {
+            return {};
+        }
+        for (int col = 0; col < num_columns; col++)
+        {
+            decode_pixel(&bytes[(long long)col * step * info.bytes_per_pixel], info, image[row][col]);
+        }
+    }
+    return image;
+}
+
+/**
+ * Scales the parameters given in pixels down to the size of a preview
+ * @param number the process number
+ * @param params the full resolution parameters
+ * @param step   input pixels per preview pixel, see read_image_subsampled()
+ * @return the parameters for the preview
+ */
+vector<double> preview_parameters(int number, vector<double> params, int step)
+{
+    if (number == 12)
+    {
+        params[0] = max(1.0, round(params[0] / step));
+        params[1] = max(1.0, round(params[1] / step));
+    }
+    else if (number == 14)
+    {
+        params[0] = params[0] / step;
+    }
+    else if (number == 15)
+    {
+        params[0] = round(params[0] / step);
+    }
+    return params;
+}
+
+/**
+ * Gets the menu prompt of a process parameter
+ * @param number the process number
+ * @param index  the parameter, 0 for the first
+ * @return what the parameter is
+ */
+string parameter_name(int number, int index)
+{
+    if (number == 5)
+    {
+        return "number of 90 degree rotations";
+    }
+    else if (number == 6)
+    {
+        return index == 0 ? "X scale integer >= 1" : "Y scale integer >= 1";
+    }
+    else if (number == 11)
+    {
+        return index == 0 ? "X shrink integer >= 1" : "Y shrink integer >= 1";
+    }
+    else if (number == 12)
+    {
+        return index == 0 ? "new width in pixels" : "new height in pixels";
+    }
+    else if (number == 14)
+    {
+        return "blur sigma in pixels > 0";
+    }
+    else if (number == 15)
+    {
+        return "blur radius in pixels";
+    }
+    else if (number == 16)
+    {
+        return "sharpen amount";
+    }
+    return "scaling factor";
+}
+
+/**
+ * Applies a process to a subsampled copy of an image and writes it as a
+ * small BMP file next to the output, e.g. out.bmp -> out_preview.bmp
+ * @param filename the input file
+ * @param output   the output file of the full resolution job
+ * @param number   the process number, anything but 13
+ * @param params   the full resolution parameters
+ * @return the preview file name, or "" if the input could not be read
+ */
+string write_preview(string filename, string output, int number, const vector<double>& params)
+{
+    int step;
+    Image image = read_image_subsampled(filename, PREVIEW_SIZE, step);
+    if (image.empty())
+    {
+        return "";
+    }
+
+    string preview = suffixed_filename(output, "_preview");
+    Image new_image = apply_process(image, number, preview_parameters(number, params, step));
+    if (new_image.empty() || !write_image(preview, new_image))
+    {
+        return "";
+    }
+    return preview;
+}
+
+/**
+ * Ends a background job with a state, unless it was cancelled first.
+ * Helper function for run_job()
+ * @param progress what the job shares with the menu
+ * @param state    JOB_DONE or JOB_FAILED
+ */
+void end_job(JobProgress& progress, int state)
+{
+    int running = JOB_RUNNING;
+    progress.state.compare_exchange_strong(running, state);
+}
+
+/**
+ * Runs a full resolution process, the body of a background job thread.
+ * The decoder and the process check for cancellation between rows, and
+ * the job checks between its steps and between output rows. It writes to a temporary file that only becomes the output once
+ * every row is written, so a cancelled job leaves no partial file.
+ * @param progress  what the job shares with the menu
+ * @param filename  the input BMP file
+ * @param output    the output BMP file
+ * @param temporary the file written before it becomes the output
+ * @param number    the process number, anything but 13
+ * @param params    the process parameters
+ */
+void run_job(shared_ptr<JobProgress> progress, string filename, string output, string temporary, int number,
+             vector<double> params)
+{
+    job_cancel = &progress->cancel;
+    Image image = read_image_parallel(filename);
+    if (image.empty())
+    {
+        end_job(*progress, JOB_FAILED);
+        return;
+    }
+    if (progress->cancel)
+    {
+        return;
+    }
+
+    // Point processes change the image in place, in the loop that checks the flag
+    Image new_image;
+    if (is_point_process(number))
+    {
+        apply_process_region(image, number, params, {0, 0, 0, 0});
+        new_image.swap(image);
+    }
+    else
+    {
+        new_image = apply_process(image, number, params);
+        Image().swap(image);
+    }
+    if (progress->cancel)
+    {
+        return;
+    }
+    if (new_image.empty())
+    {
+        end_job(*progress, JOB_FAILED);
+        return;
+    }
+
+    ofstream stream(temporary, ios::out | ios::binary);
+    ImageInfo info = make_output_info("bmp", new_image[0].size(), new_image.size());
+    write_header(stream, info);
+    vector<unsigned char> bytes;
+    for (int i = 0; i < info.height && !progress->cancel; i++)
+    {
+        write_row(stream, info, new_image[info.height - 1 - i], bytes);
+    }
+    stream.close();
+
+    error_code error;
+    if (progress->cancel || !stream)
+    {
+        filesystem::remove(temporary, error);
+        end_job(*progress, JOB_FAILED);
+        return;
+    }
+    filesystem::rename(temporary, output, error);
+    end_job(*progress, error ? JOB_FAILED : JOB_DONE);
+}
+
+/**
+ * Stops a background job without waiting for it. Its thread ends at its
+ * next cancellation check, within a few rows of the read or the process,
+ * and is joined by finish_job().
+ * @param job the job
+ * @return True if the job was running and false otherwise
+ */
+bool cancel_job(BackgroundJob& job)
+{
+    if (!job.worker.joinable())
+    {
+        return false;
+    }
+    job.progress->cancel = true;
+    int running = JOB_RUNNING;
+    bool cancelled = job.progress->state.compare_exchange_strong(running, JOB_CANCELLED);
+    job.stopping.push_back(move(job.worker));
+    return cancelled;
+}
+
+/**
+ * Waits for a background job to finish its output, and for the cancelled
+ * jobs before it to stop
+ * @param job the job
+ */
+void finish_job(BackgroundJob& job)
+{
+    if (job.worker.joinable())
+    {
+        if (job.progress->state == JOB_RUNNING)
+        {
+            cout << "Waiting for " << job.output << " to finish...\n";
+        }
+        job.worker.join();
+    }
+    for (size_t i = 0; i < job.stopping.size(); i++)
+    {
+        job.stopping[i].join();
+    }
+    job.stopping.clear();
+}
+
+/**
+ * Starts a full resolution process on its own thread, after cancelling the
+ * job that was running before and waiting for it to stop, so only one
+ * job's images are held at a time
+ * @param job      the job
+ * @param filename the input BMP file
+ * @param output   the output BMP file
+ * @param number   the process number, anything but 13
+ * @param params   the process parameters
+ */
+void start_job(BackgroundJob& job, string filename, string output, int number, const vector<double>& params)
+{
+    cancel_job(job);
+    finish_job(job);
+    job.progress = make_shared<JobProgress>();
+    job.progress->state = JOB_RUNNING;
+    job.output = output;
+    job.runs++;
+    string temporary = output + ".part" + to_string(job.runs);
+    job.worker = thread(run_job, job.progress, filename, output, temporary, number, params);
+}
+
+/**
+ * Describes where a background job is for the menu
+ * @param job the job
+ * @return the description
+ */
+string job_status(const BackgroundJob& job)
+{
+    switch (job.progress->state)
+    {
+        case JOB_RUNNING:   return "is still processing";
+        case JOB_DONE:      return "is finished";
+        case JOB_CANCELLED: return "was cancelled";
+        case JOB_FAILED:    return "failed";
+        default:            return "";
+    }
+}
+
+//***************************************************************************************************//
+//                                  DIFFERENTIAL SELF TEST                                           //
+//***************************************************************************************************//
+
+// Random images tried by --self-test unless a count is given
+const int SELF_TEST_ITERATIONS = 200;
+
+// Mismatches after which --self-test stops early
+const int SELF_TEST_MAX_FAILURES = 20;
+
+/**
+ * Makes an image of random pixels
+ * @param random the random number generator
+ * @param width  WIDTH of the image
+ * @param height HEIGHT of the image
+ * @return the image
+ */
+Image random_image(mt19937& random, int width, int height)
+{
+    uniform_int_distribution<int> channel(0, 255);
+    Image image(height, PixelRow (width));
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            image[row][col].red = channel(random);
+            image[row][col].green = channel(random);
+            image[row][col].blue = channel(random);
+        }
+    }
+    return image;
+}
+
+/**
+ * Makes a random region inside an image
+ * @param random the random number generator
+ * @param width  WIDTH of the image
+ * @param height HEIGHT of the image
+ * @return a region of at least one pixel
+ */
+Region random_region(mt19937& random, int width, int height)
+{
+    Region region;
+    region.x = uniform_int_distribution<int>(0, width - 1)(random);
+    region.y = uniform_int_distribution<int>(0, height - 1)(random);
+    region.width = uniform_int_distribution<int>(1, width - region.x)(random);
+    region.height = uniform_int_distribution<int>(1, height - region.y)(random);
+    return region;
+}
+
+/**
+ * Copies a region out of an image
+ * @param image  the image
+ * @param region the region, inside the image
+ * @return the region as an image
+ */
+Image cut_region(const Image& image, Region region)
+{
+    Image new_image(region.height, PixelRow (region.width));
+    for (int row = 0; row < region.height; row++)
+    {
+        copy(image[region.y + row].begin() + region.x, image[region.y + row].begin() + region.x + region.width,
+             new_image[row].begin());
+    }
+    return new_image;
+}
+
+/**
+ * Copies an image into a region of another image
+ * @param image  the image to change
+ * @param patch  the image to copy, the size of the region
+ * @param region the region
+ */
+void paste_region(Image& image, const Image& patch, Region region)
+{
+    for (int row = 0; row < region.height; row++)
+    {
+        copy(patch[row].begin(), patch[row].end(), image[region.y + row].begin() + region.x);
+    }
+}
+
+/**
+ * Keeps every step-th row and column of an image, starting with the first
+ * @param image the image
+ * @param step  the distance between kept pixels
+ * @return the smaller image
+ */
+Image subsample(const Image& image, int step)
+{
+    Image new_image;
+    for (size_t row = 0; row < image.size(); row += step)
+    {
+        PixelRow new_row;
+        for (size_t col = 0; col < image[row].size(); col += step)
+        {
+            new_row.push_back(image[row][col]);
+        }
+        new_image.push_back(new_row);
+    }
+    return new_image;
+}
+
+/**
+ * Gets an image the way write_image() stores it, one byte per channel.
+ * Some processes leave values outside 0 to 255 that only the writer cuts.
+ * @param image the image
+ * @return the image with every channel cut to a byte
+ */
+Image as_written(Image image)
+{
+    for (int row = 0; row < (int)image.size(); row++)
+    {
+        for (int col = 0; col < (int)image[row].size(); col++)
+        {
+            image[row][col].red = (unsigned char)image[row][col].red;
+            image[row][col].green = (unsigned char)image[row][col].green;
+            image[row][col].blue = (unsigned char)image[row][col].blue;
+        }
+    }
+    return image;
+}
+
+/**
+ * Describes a process and its parameters for a self test message
+ * @param number the process number
+ * @param params the process parameters
+ * @return e.g. "process 8 (0.25)"
+ */
+string describe_process(int number, const vector<double>& params)
+{
+    ostringstream text;
+    text << "process " << number;
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        text << (i == 0 ? " (" : ", ") << params[i];
+    }
+    text << (params.empty() ? "" : ")");
+    return text.str();
+}
+
+/**
+ * Compares a result against the reference result and prints the first
+ * pixel that differs
+ * @param expected the reference result
+ * @param actual   the result to check
+ * @param what     the check, for the message
+ * @return True if both are the same and false otherwise
+ */
+bool same_image(const Image& expected, const Image& actual, string what)
+{
+    int width = expected.empty() ? 0 : expected[0].size();
+    int actual_width = actual.empty() ? 0 : actual[0].size();
+    if (expected.size() != actual.size() || width != actual_width)
+    {
+        cout << "MISMATCH " << what << ": expected " << width << "x" << expected.size()
+             << " pixels, got " << actual_width << "x" << actual.size() << "\n";
+        return false;
+    }
+
+    for (int row = 0; row < (int)expected.size(); row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            const Pixel& a = expected[row][col];
+            const Pixel& b = actual[row][col];
+            if (a.red != b.red || a.green != b.green || a.blue != b.blue)
+            {
+                cout << "MISMATCH " << what << ": first different pixel at row " << row << ", column " << col
+                     << ": expected (" << a.red << ", " << a.green << ", " << a.blue << "), got ("
+                     << b.red << ", " << b.green << ", " << b.blue << ")\n";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Compares an encoded BMP against the one written by write_image() and
+ * prints the first byte that differs, with its pixel
+ * @param expected the bytes written by write_image()
+ * @param actual   the bytes to check
+ * @param width    WIDTH of the image
+ * @param height   HEIGHT of the image
+ * @param what     the check, for the message
+ * @return True if both are the same and false otherwise
+ */
+bool same_bmp(const string& expected, const string& actual, int width, int height, string what)
+{
+    size_t offset = 0;
+    while (offset < expected.size() && offset < actual.size() && expected[offset] == actual[offset])
+    {
+        offset++;
+    }
+    if (offset == expected.size() && offset == actual.size())
+    {
+        return true;
+    }
+
+    cout << "MISMATCH " << what << ": first different byte at offset " << offset;
+    int row_bytes = (width * 3 + 3) / 4 * 4;
+    if (offset >= 54 && offset < 54 + (size_t)row_bytes * height)
+    {
+        // Rows are stored bottom first, blue, green, red
+        int file_row = (offset - 54) / row_bytes;
+        int col = (offset - 54) % row_bytes / 3;
+        cout << ", row " << height - 1 - file_row << (col < width ? ", column " + to_string(col) : ", padding");
+    }
+    cout << " (" << expected.size() << " bytes expected, " << actual.size() << " written)\n";
+    return false;
+}
+
+/**
+ * Runs a reference process, the original scalar process_1() ... process_10()
+ * @param image  the input image
+ * @param number the process number, 1 to 10
+ * @param params the process parameters
+ * @return the reference result
+ */
+Image reference_process(const Image& image, int number, const vector<double>& params)
+{
+    switch (number)
+    {
+        case 1:  return process_1(image);
+        case 2:  return process_2(image, params[0]);
+        case 3:  return process_3(image);
+        case 4:  return process_4(image);
+        case 5:  return process_5(image, params[0]);
+        case 6:  return process_6(image, params[0], params[1]);
+        case 7:  return process_7(image);
+        case 8:  return process_8(image, params[0]);
+        case 9:  return process_9(image, params[0]);
+        default: return process_10(image);
+    }
+}
+
+/**
+ * Picks random parameters for a process
+ * @param random the random number generator
+ * @param number the process number
+ * @return the parameters, process_parameter_count() of them
+ */
+vector<double> random_parameters(mt19937& random, int number)
+{
+    uniform_real_distribution<double> factor(0, 1);
+    if (number == 2 || number == 8 || number == 9)
+    {
+        return {factor(random)};
+    }
+    else if (number == 5)
+    {
+        // Negative counts too, process_5() turns most of them by 270 degrees
+        return {(double)uniform_int_distribution<int>(-7, 7)(random)};
+    }
+    else if (number == 6 || number == 11)
+    {
+        uniform_int_distribution<int> scale(1, 4);
+        return {(double)scale(random), (double)scale(random)};
+    }
+    else if (number == 12)
+    {
+        uniform_int_distribution<int> size(1, 100);
+        return {(double)size(random), (double)size(random)};
+    }
+    else if (number == 14)
+    {
+        return {0.3 + 3 * factor(random)};
+    }
+    else if (number == 15)
+    {
+        return {(double)uniform_int_distribution<int>(0, 6)(random)};
+    }
+    else if (number == 16)
+    {
+        return {2 * factor(random)};
+    }
+    return {};
+}
+
+/**
+ * Runs a process through stream_process() on in-memory streams and decodes
+ * the result again
+ * @param input      the encoded input image
+ * @param filename   the input file for the parallel decoder, or "-" to decode the stream
+ * @param out_format "bmp", "ppm" or "pam"
+ * @param number     the process number
+ * @param params     the process parameters
+ * @param strategy   the strategy
+ * @param region     the region of interest, width 0 for the whole image
+ * @return the result, empty if the process failed
+ */
+Image stream_result(const string& input, string filename, string out_format, int number,
+                    const vector<double>& params, Strategy strategy, Region region = {0, 0, 0, 0})
+{
+    istringstream in(input);
+    ostringstream out;
+    ImageInfo in_info;
+    if (!read_header(in, in_info) || !stream_process(in, in_info, filename, 0, out, out_format, number, params,
+                                                     strategy, region))
+    {
+        return {};
+    }
+
+    istringstream result(out.str());
+    ImageInfo out_info;
+    if (!read_header(result, out_info))
+    {
+        return {};
+    }
+    return read_rows(result, out_info);
+}
+
+/**
+ * Checks the faster, streaming and parallel code paths against the original
+ * read_image(), write_image() and process_1() ... process_10() on random
+ * images, including odd widths that need row padding. Prints the first
+ * different pixel of every mismatch.
+ * @param iterations number of random images
+ * @param seed       seed of the random numbers, printed to repeat a run
+ * @return the exit code, 0 if everything matched
+ */
+int self_test(int iterations, unsigned int seed)
+{
+    cout << "Self test: " << iterations << " random images, seed " << seed << "\n";
+    mt19937 random(seed);
+    string filename = (filesystem::temp_directory_path() / ("self-test-" + to_string(getpid()) + ".bmp")).string();
+    string formats[3] = {"bmp", "ppm", "pam"};
+    Strategy strategies[3] = {STREAM_ROWS, SCATTER_ROWS, WHOLE_IMAGE};
+    int checks = 0;
+    int failures = 0;
+
+    for (int i = 0; i < iterations && failures < SELF_TEST_MAX_FAILURES; i++)
+    {
+        // Every 50th image is big enough for several decoding chunks
+        int width = i % 50 == 49 ? 701 : uniform_int_distribution<int>(1, 67)(random);
+        int height = i % 50 == 49 ? 523 : uniform_int_distribution<int>(1, 45)(random);
+        string size = to_string(width) + "x" + to_string(height);
+        Image image = random_image(random, width, height);
+
+        // Decoders against read_image()
+        write_image(filename, image);
+        Image reference = read_image(filename);
+        checks++;
+        failures += !same_image(image, reference, size + " read_image");
+
+        int thread_counts[4] = {1, 2, 3, 8};
+        for (int j = 0; j < 4; j++)
+        {
+            checks++;
+            failures += !same_image(reference, read_image_parallel(filename, thread_counts[j]),
+                                    size + " read_image_parallel, " + to_string(thread_counts[j]) + " threads");
+        }
+
+        ifstream file(filename, ios::in | ios::binary);
+        ImageInfo info;
+        checks++;
+        failures += !same_image(reference, read_header(file, info) ? read_rows(file, info) : Image(),
+                                size + " read_rows");
+        file.close();
+
+        // A copy no bigger than max_size keeps every step-th pixel
+        int max_size = uniform_int_distribution<int>(1, max(width, height))(random);
+        int step = 0;
+        Image subsampled = read_image_subsampled(filename, max_size, step);
+        checks++;
+        failures += !same_image(subsample(reference, (max(width, height) + max_size - 1) / max_size), subsampled,
+                                size + " read_image_subsampled, at most " + to_string(max_size) + " pixels");
+
+        Region region = random_region(random, width, height);
+        string region_text = " region " + to_string(region.x) + "," + to_string(region.y) + ","
+                             + to_string(region.width) + "," + to_string(region.height);
+        checks++;
+        failures += !same_image(cut_region(reference, region), read_image_parallel(filename, 3, region),
+                                size + " read_image_parallel" + region_text);
+
+        // Encoders against write_image()
+        ifstream written(filename, ios::in | ios::binary);
+        string bmp((istreambuf_iterator<char>(written)), istreambuf_iterator<char>());
+        ostringstream encoded;
+        write_rows(encoded, "bmp", reference);
+        checks++;
+        failures += !same_bmp(bmp, encoded.str(), width, height, size + " write_rows");
+
+        istringstream stream(bmp);
+        checks++;
+        failures += !same_image(cut_region(reference, region),
+                                read_header(stream, info) ? read_region(stream, info, "-", 0, region) : Image(),
+                                size + " read_region" + region_text);
+
+        // Every process against its reference, through every strategy that can run it
+        string in_format = formats[uniform_int_distribution<int>(0, 2)(random)];
+        string out_format = formats[uniform_int_distribution<int>(0, 2)(random)];
+        ostringstream input;
+        write_rows(input, in_format, reference);
+        for (int number = 1; number <= 10; number++)
+        {
+            vector<double> params = random_parameters(random, number);
+            string what = size + " " + describe_process(number, params);
+            Image expected = reference_process(reference, number, params);
+            Image written = as_written(expected);
+
+            checks++;
+            failures += !same_image(expected, apply_process(reference, number, params), what + ", apply_process");
+
+            long long new_width, new_height;
+            output_size(number, params, width, height, new_width, new_height);
+            ImageInfo in_info = make_output_info(in_format, width, height);
+            ImageInfo out_info = make_output_info(out_format, new_width, new_height);
+            for (int j = 0; j < 3; j++)
+            {
+                if (strategy_available(strategies[j], number, in_info, out_info, {0, 0, 0, 0}))
+                {
+                    checks++;
+                    failures += !same_image(written, stream_result(input.str(), "-", out_format, number, params,
+                                                                    strategies[j]),
+                                            what + ", " + in_format + " to " + out_format + ", "
+                                            + strategy_name(strategies[j]));
+                }
+            }
+            checks++;
+            failures += !same_image(written, stream_result(bmp, filename, out_format, number, params, WHOLE_IMAGE),
+                                    what + ", parallel decode to " + out_format);
+
+            if (is_point_process(number))
+            {
+                // A region gives the same pixels as processing a cut out copy
+                Image in_place = reference;
+                Image with_region = reference;
+                apply_process_region(in_place, number, params, region);
+                paste_region(with_region, reference_process(cut_region(reference, region), number, params), region);
+                checks++;
+                failures += !same_image(with_region, in_place, what + ", apply_process_region" + region_text);
+                Image streamed = stream_result(bmp, "-", "bmp", number, params, STREAM_ROWS, region);
+                checks++;
+                failures += !same_image(as_written(with_region), streamed, what + ", streaming rows" + region_text);
+            }
+        }
+
+        // The resizing processes give the same image through every strategy that can run them
+        for (int number = 11; number <= 12; number++)
+        {
+            vector<double> params = random_parameters(random, number);
+            string what = size + " " + describe_process(number, params);
+            Image expected = number == 11 ? process_11(reference, params[0], params[1])
+                                          : process_12(reference, params[0], params[1]);
+            checks++;
+            failures += !same_image(expected, apply_process(reference, number, params), what + ", apply_process");
+
+            long long new_width, new_height;
+            output_size(number, params, width, height, new_width, new_height);
+            ImageInfo in_info = make_output_info(in_format, width, height);
+            ImageInfo out_info = make_output_info(out_format, new_width, new_height);
+            for (int j = 0; j < 3; j++)
+            {
+                if (strategy_available(strategies[j], number, in_info, out_info, {0, 0, 0, 0}))
+                {
+                    checks++;
+                    failures += !same_image(expected, stream_result(input.str(), "-", out_format, number, params,
+                                                                    strategies[j]),
+                                            what + ", " + in_format + " to " + out_format + ", "
+                                            + strategy_name(strategies[j]));
+                }
+            }
+        }
+
+        // The streamed pyramid pairs the same rows as process_13() in BMP (bottom first) order too
+        int levels = uniform_int_distribution<int>(1, 6)(random);
+        vector<Image> expected_levels = process_13(reference, levels);
+        string encodings[2] = {bmp, input.str()};
+        for (int j = 0; j < 2; j++)
+        {
+            istringstream pyramid_stream(encodings[j]);
+            vector<Image> streamed_levels;
+            bool streamed = read_header(pyramid_stream, info)
+                            && stream_pyramid(pyramid_stream, info, levels, streamed_levels);
+            for (int level = 0; level < (int)expected_levels.size(); level++)
+            {
+                checks++;
+                failures += !same_image(expected_levels[level],
+                                        streamed && level < (int)streamed_levels.size() ? streamed_levels[level]
+                                                                                        : Image(),
+                                        size + " " + describe_process(13, {(double)levels}) + ", level "
+                                        + to_string(level) + " streamed from " + info.format);
+            }
+        }
+        for (int number = 14; number <= 17; number++)
+        {
+            vector<double> params = random_parameters(random, number);
+            Image in_place = reference;
+            apply_process_region(in_place, number, params, region);
+            Image expected = reference;
+            paste_region(expected, cut_region(apply_process(reference, number, params), region), region);
+            checks++;
+            failures += !same_image(expected, in_place, size + " " + describe_process(number, params) + region_text);
+        }
+    }
+
+    error_code error;
+    filesystem::remove(filename, error);
+    cout << checks << " checks, " << failures << " mismatches\n";
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    // Check the optimized code paths against the original functions
+    if (argc > 1 && string(argv[1]) == "--self-test")
+    {
+        int iterations = argc > 2 ? atoi(argv[2]) : SELF_TEST_ITERATIONS;
+        unsigned int seed = argc > 3 ? strtoul(argv[3], nullptr, 10) : random_device()();
+        return self_test(iterations, seed);
+    }
+
+    // Any arguments run a single process without the menu
+    if (argc > 1)
+    {
+        ios::sync_with_stdio(false);
+        return run_batch(argc, argv);
+    }
+
+    cout << "CSPB 1300 Image Processing Application\n";
+    cout << "Enter the name of the BMP file to process: ";
+    string filename;
+    BackgroundJob job;
+
+    while (cin >> filename)
+    {
+        menu:
+        cout << "---------------------------------------\n\n";
+        cout << "IMAGE PROCESSING MENU\n\n";
+        if (job.progress->state != JOB_NONE)
+        {
+            cout << "Background job: " << job.output << " " << job_status(job) << "\n\n";
+        }
+        cout << "0) Change image (current: " << filename << ")\n";
+        cout << "1) Vignette\n";
+        cout << "2) Clarendon\n";
+        cout << "3) Grayscale\n";
+        cout << "4) Rotate by 90 degrees clockwise\n";
+        cout << "5) Rotate by multiple 90 degrees\n";
+        cout << "6) Enlarge in x and y direction\n";
+        cout << "7) High contrast black and white\n";
+        cout << "8) Lighten by scaling factor\n";
+        cout << "9) Darken by scaling factor\n";
+        cout << "10) Convert to black, white, red, blue, green only\n";
+        cout << "11) Shrink in x and y direction (area average)\n";
+        cout << "12) Resize to width and height (bilinear)\n";
+        cout << "13) Thumbnail pyramid (1/2, 1/4, 1/8, ...)\n";
+        cout << "14) Gaussian blur\n";
+        cout << "15) Box blur\n";
+        cout << "16) Sharpen\n";
+        cout << "17) Edge detection\n";
+        cout << "P) Preview a process, then run it on the full image in the background\n\n";
+        cout << "Enter your selection (Q to quit): ";
+        string user_input;
+        cin >> user_input;
+        cout << "\n";   
+
+        // Picking another process cancels the background job
+        int selection = atoi(user_input.c_str());
+        if (selection >= 1 && selection <= 17)
+        {
+            if (cancel_job(job))
+            {
+                cout << "Cancelled background job for " << job.output << "\n\n";
+            }
+        }
+
+        if (user_input == "0")
+        {
+            cout << "Change image selected\n\n";
+            cout << "Enter the name of the new BMP file to process: ";
+            cin >> filename;
+            cout << "\n";
+            cout << "New Filename: " << filename << "\n\n";
+            Image image = read_image_parallel(filename);
+            cout << "Successfully changed image to " << filename << "!" << "\n";
+            goto menu;
+        }
+        else if (user_input == "1")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Vignette selected\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            cout << "New Filename: " << new_filename << "\n\n";
+            Image new_image = process_1(image);
+            bool success = write_image(new_filename, new_image);
+            cout << "Successfully applied vignette!\n\n\n";
+            goto menu;
+        }
+        else if (user_input == "2")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Clarendon selected\n\n";
+            cout << "Enter scaling factor: ";
+            double scaling_factor;
+            cin >> scaling_factor;
+            cout << "\n";
+            cout << "Selected scaling factor: " << scaling_factor << "\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            cout << "New Filename: " << new_filename << "\n\n";
+            Image new_image = process_2(image, scaling_factor);
+            bool success = write_image(new_filename, new_image);
+            cout << "Successfully applied clarendon!" << "\n";
+            goto menu;            
+        }
+        else if (user_input == "3")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Grayscale selected\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            cout << "New Filename: " << new_filename << "\n\n";
+            Image new_image = process_3(image);
+            bool success = write_image(new_filename, new_image);
+            cout << "Successfully applied grayscale!" << "\n";
+            goto menu;
+        }
+        else if (user_input == "4")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Rotate 90 degrees selected\n\n";
             cout << "Enter output BMP filename: ";
             string new_filename;
             cin >> new_filename;
             cout << "\n";
             cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_4(image);
+            Image new_image = process_4(image);
             bool success = write_image(new_filename, new_image);
             cout << "Successfully applied 90 degree rotation!" << "\n";
             goto menu;
         }
         else if (user_input == "5")
         {
-            vector<vector<Pixel>> image = read_image(filename);
+            Image image = read_image_parallel(filename);
             cout << "Rotate multiple 90 degrees selected\n\n";
             cout << "Enter number of 90 degree rotations: ";
             double rotations;
@@ -780,14 +4962,14 @@ int main()
             cin >> new_filename;
             cout << "\n";
             cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_5(image, rotations);
+            Image new_image = rotate_image(image, quarter_turns(5, {rotations}));
             bool success = write_image(new_filename, new_image);
             cout << "Successfully applied multiple 90 degree rotations!" << "\n";
             goto menu;
         }
         else if (user_input == "6")
         {
-            vector<vector<Pixel>> image = read_image(filename);
+            Image image = read_image_parallel(filename);
             cout << "Scale image selected\n\n";
             cout << "Enter X scale integer > 1: ";
             double x_scale;
@@ -804,28 +4986,28 @@ int main()
             cin >> new_filename;
             cout << "\n";
             cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_6(image, x_scale, y_scale);
+            Image new_image = process_6(image, x_scale, y_scale);
             bool success = write_image(new_filename, new_image);
             cout << "Successfully scaled!" << "\n";
             goto menu;
         }
         else if (user_input == "7")
         {
-            vector<vector<Pixel>> image = read_image(filename);
+            Image image = read_image_parallel(filename);
             cout << "High contrast selected\n\n";
             cout << "Enter output BMP filename: ";
             string new_filename;
             cin >> new_filename;
             cout << "\n";
             cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_7(image);
+            Image new_image = process_7(image);
             bool success = write_image(new_filename, new_image);
             cout << "Successfully applied high contrast!" << "\n";
             goto menu;
         }
         else if (user_input == "8")
         {
-            vector<vector<Pixel>> image = read_image(filename);
+            Image image = read_image_parallel(filename);
             cout << "Lighten selected\n\n";
             cout << "Enter scaling factor: ";
             double scaling_factor;
@@ -837,14 +5019,14 @@ int main()
             cin >> new_filename;
             cout << "\n";
             cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_8(image, scaling_factor);               
+            Image new_image = process_8(image, scaling_factor);               
             bool success = write_image(new_filename, new_image);
             cout << "Successfully lightened!" << "\n";
             goto menu;
         }
         else if (user_input == "9")
         {
-            vector<vector<Pixel>> image = read_image(filename);
+            Image image = read_image_parallel(filename);
             cout << "Darken selected\n\n";
             cout << "Enter scaling factor: ";
             double scaling_factor;
@@ -856,25 +5038,213 @@ int main()
             cin >> new_filename;
             cout << "\n";
             cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_9(image, scaling_factor);
+            Image new_image = process_9(image, scaling_factor);
             bool success = write_image(new_filename, new_image);
             cout << "Successfully darkened!" << "\n";
             goto menu;
         }
         else if (user_input == "10")
         {
-            vector<vector<Pixel>> image = read_image(filename);
+            Image image = read_image_parallel(filename);
             cout << "Black, white, red, green, blue selected\n\n";
             cout << "Enter output BMP filename: ";
             string new_filename;
             cin >> new_filename;
             cout << "\n";
             cout << "New Filename: " << new_filename << "\n\n";
-            vector<vector<Pixel>> new_image = process_10(image);
+            Image new_image = process_10(image);
             bool success = write_image(new_filename, new_image);
             cout << "Successfully applied black, white, red, green, blue!" << "\n";
             goto menu;
         }
+        else if (user_input == "11")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Shrink image selected\n\n";
+            cout << "Enter X shrink integer >= 1: ";
+            int x_scale;
+            cin >> x_scale;
+            cout << "\n";
+            cout << "Selected X shrink: " << x_scale << "\n\n";
+            cout << "Enter Y shrink integer >= 1: ";
+            int y_scale;
+            cin >> y_scale;
+            cout << "\n";
+            cout << "Selected Y shrink: " << y_scale << "\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            cout << "New Filename: " << new_filename << "\n\n";
+            Image new_image = process_11(image, max(x_scale, 1), max(y_scale, 1));
+            bool success = write_image(new_filename, new_image);
+            cout << "Successfully shrunk!" << "\n";
+            goto menu;
+        }
+        else if (user_input == "12")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Resize image selected\n\n";
+            cout << "Enter new width in pixels: ";
+            int new_width;
+            cin >> new_width;
+            cout << "\n";
+            cout << "Selected width: " << new_width << "\n\n";
+            cout << "Enter new height in pixels: ";
+            int new_height;
+            cin >> new_height;
+            cout << "\n";
+            cout << "Selected height: " << new_height << "\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            cout << "New Filename: " << new_filename << "\n\n";
+            Image new_image = process_12(image, max(new_width, 1), max(new_height, 1));
+            bool success = write_image(new_filename, new_image);
+            cout << "Successfully resized!" << "\n";
+            goto menu;
+        }
+        else if (user_input == "13")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Thumbnail pyramid selected\n\n";
+            cout << "Enter number of levels: ";
+            int levels;
+            cin >> levels;
+            cout << "\n";
+            cout << "Selected number of levels: " << levels << "\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            vector<Image> pyramid = process_13(image, levels);
+            for (int level = 0; level < (int)pyramid.size(); level++)
+            {
+                cout << "New Filename: " << pyramid_filename(new_filename, level) << "\n";
+                bool success = write_image(pyramid_filename(new_filename, level), pyramid[level]);
+            }
+            cout << "\nSuccessfully built thumbnail pyramid!" << "\n";
+            goto menu;
+        }
+        else if (user_input == "14")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Gaussian blur selected\n\n";
+            cout << "Enter blur sigma in pixels > 0: ";
+            double sigma;
+            cin >> sigma;
+            cout << "\n";
+            cout << "Selected sigma: " << sigma << "\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            cout << "New Filename: " << new_filename << "\n\n";
+            Image new_image = process_14(image, sigma > 0 ? sigma : 1);
+            bool success = write_image(new_filename, new_image);
+            cout << "Successfully blurred!" << "\n";
+            goto menu;
+        }
+        else if (user_input == "15")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Box blur selected\n\n";
+            cout << "Enter blur radius in pixels: ";
+            int radius;
+            cin >> radius;
+            cout << "\n";
+            cout << "Selected radius: " << radius << "\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            cout << "New Filename: " << new_filename << "\n\n";
+            Image new_image = process_15(image, max(radius, 0));
+            bool success = write_image(new_filename, new_image);
+            cout << "Successfully blurred!" << "\n";
+            goto menu;
+        }
+        else if (user_input == "16")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Sharpen selected\n\n";
+            cout << "Enter sharpen amount: ";
+            double amount;
+            cin >> amount;
+            cout << "\n";
+            cout << "Selected amount: " << amount << "\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            cout << "New Filename: " << new_filename << "\n\n";
+            Image new_image = process_16(image, amount);
+            bool success = write_image(new_filename, new_image);
+            cout << "Successfully sharpened!" << "\n";
+            goto menu;
+        }
+        else if (user_input == "17")
+        {
+            Image image = read_image_parallel(filename);
+            cout << "Edge detection selected\n\n";
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+            cout << "New Filename: " << new_filename << "\n\n";
+            Image new_image = process_17(image);
+            bool success = write_image(new_filename, new_image);
+            cout << "Successfully detected edges!" << "\n";
+            goto menu;
+        }
+        else if (user_input == "P" || user_input == "p")
+        {
+            cout << "Preview selected\n\n";
+            cout << "Enter the process to preview (1-17 except 13): ";
+            int number;
+            cin >> number;
+            cout << "\n";
+            if (number == 13 || process_parameter_count(number) < 0)
+            {
+                cout << "Process " << number << " can't be previewed\n\n";
+                goto menu;
+            }
+            vector<double> params;
+            for (int i = 0; i < process_parameter_count(number); i++)
+            {
+                cout << "Enter " << parameter_name(number, i) << ": ";
+                double param;
+                cin >> param;
+                cout << "\n";
+                params.push_back(param);
+            }
+            if (parameter_error(number, params) != "")
+            {
+                cout << "Error: " << parameter_error(number, params) << "\n\n";
+                goto menu;
+            }
+            cout << "Enter output BMP filename: ";
+            string new_filename;
+            cin >> new_filename;
+            cout << "\n";
+
+            // An older job can wind down while the preview is made
+            cancel_job(job);
+            auto start = chrono::steady_clock::now();
+            string preview = write_preview(filename, new_filename, number, params);
+            if (preview == "")
+            {
+                cout << "Error: could not read " << filename << "\n\n";
+                goto menu;
+            }
+            auto milliseconds = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+            cout << "Preview written to " << preview << " in " << milliseconds.count() << " ms\n";
+
+            start_job(job, filename, new_filename, number, params);
+            cout << "Processing " << new_filename << " in the background, pick another process to cancel it\n\n";
+            goto menu;
+        }
         else if (user_input == "Q")
         {
             cout << "Goodbye! Program will now close. Have a great day!\n\n";
@@ -882,5 +5252,8 @@ int main()
             break;
         }    
     }
+
+    // A background job writes its output before the program closes
+    finish_job(job);
     return 0;
 }
\ No newline at end of file